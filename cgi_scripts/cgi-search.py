@@ -4,9 +4,14 @@
 #
 # Expects to be run with $NUTRIMATIC_FIND_EXPR and $NUTRIMATIC_INDEX set to the
 # pathnames of the find-expr binary and the merged .index file, respectively.
+# If $NUTRIMATIC_CURSORS names a directory, find-expr leaves a cursor there at
+# the end of each page after the first, and the next page goes on from it
+# instead of starting the search over.  Cursors that would grow too big are
+# not written, and those that outlive CURSOR_LIFETIME are removed.
 
 import cgi
 import cgitb; cgitb.enable()
+import hashlib
 import html
 import math
 import os
@@ -14,6 +19,7 @@ import resource
 import signal
 import subprocess
 import sys
+import time
 import urllib
 
 # When find-expr reports searching this many nodes, give up and
@@ -23,6 +29,17 @@ MAX_COMPUTATION = 1000000
 # Number of results to print per page
 PER_PAGE = 100
 
+# Most nodes find-expr may keep waiting to be searched (about 50 bytes each);
+# beyond this it drops the least likely, rather than running out of memory
+MAX_FRONTIER = 10000000
+
+# Cursors bigger than this are not written (the frontier is most of a
+# cursor, at up to MAX_FRONTIER nodes); the next page searches again
+MAX_CURSOR_BYTES = 32 * 1024 * 1024
+
+# Seconds a cursor is kept after it was written
+CURSOR_LIFETIME = 3600
+
 #####
 # HTML output templates
 
@@ -141,6 +158,40 @@ EDITIONS = [
 
 binary = os.environ["NUTRIMATIC_FIND_EXPR"]
 index = os.environ["NUTRIMATIC_INDEX"]
+cursors = os.environ.get("NUTRIMATIC_CURSORS")
+
+def cursor_path(query, start):
+  """Where to keep a cursor for a query's results from start on, or None."""
+  # find-expr can only save searches of one index file without deltas
+  stem = index[:-len(".index")] if index.endswith(".index") else index
+  if not cursors or os.path.exists(stem + ".delta.0.index"):
+    return None
+  try:
+    stat = os.stat(index)
+  except OSError:
+    return None
+
+  # A new index (with a new size or time) gets new cursors.
+  key = "%s\n%d\n%d\n%d" % (query, start, stat.st_size, stat.st_mtime_ns)
+  name = hashlib.sha256(key.encode()).hexdigest()[:32] + ".cursor"
+  return os.path.join(cursors, name)
+
+def remove_old_cursors():
+  """Removes cursors (and any left half written, as NAME.cursor.XXXXXX) older
+  than CURSOR_LIFETIME."""
+  oldest = time.time() - CURSOR_LIFETIME
+  try:
+    entries = list(os.scandir(cursors))
+  except OSError:
+    return
+  for entry in entries:
+    if not entry.name.endswith(".cursor") and ".cursor." not in entry.name:
+      continue
+    try:
+      if entry.stat().st_mtime < oldest:
+        os.remove(entry.path)
+    except OSError:
+      pass  # Another request got to it first
 
 print('Content-type: text/html')
 print()
@@ -191,17 +242,47 @@ soft, hard = resource.getrlimit(resource.RLIMIT_AS)
 if hard == -1 or hard > 2048 * 1024 * 1024: hard = 2048 * 1024 * 1024
 resource.setrlimit(resource.RLIMIT_AS, (hard, hard))
 
-proc = subprocess.Popen([binary, index, query],
-    preexec_fn=lambda: signal.signal(signal.SIGPIPE, signal.SIG_DFL),
-    stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+# Most searches never go past the first page, so only later pages (which
+# someone is paging through) leave a cursor.
+resume_from = cursor_path(query, start) if start > 0 else None
+save_to = cursor_path(query, start + num) if start > 0 else None
+
+def run_search(resume):
+  """Starts find-expr, from the cursor for start if resume is set."""
+  args = [binary, "-b", str(MAX_FRONTIER)]
+  if resume:
+    args += ["-r", resume_from]
+  if save_to:
+    args += ["-n", str(num if resume else start + num), "-w", save_to,
+             "-W", str(MAX_CURSOR_BYTES)]
+  return subprocess.Popen(args + [index, query],
+      preexec_fn=lambda: signal.signal(signal.SIGPIPE, signal.SIG_DFL),
+      stdout=subprocess.PIPE, stderr=subprocess.PIPE)
+
+resuming = bool(resume_from and os.path.exists(resume_from))
+proc = run_search(resuming)
+rn = start if resuming else 0
+more = False  # If find-expr, having saved a cursor, found more after it
+output = False  # If find-expr has printed anything
 
 print(RESULT_PAGE_BEGIN % {"query": html.escape(query)})
 
-rn = 0
 while 1:
   line = proc.stdout.readline().decode()
   if not line:
     error = proc.stderr.read().decode().strip()
+    if resuming and not output and proc.wait() == 1:
+      # The cursor wouldn't do (cut short, say, or removed as too old), so
+      # search from the start, as without cursors
+      try:
+        os.remove(resume_from)
+      except OSError:
+        pass
+      resuming = False
+      proc = run_search(False)
+      rn = 0
+      continue
+
     if error:
       print(RESULT_ERROR % {"text": html.escape(error).replace("\n", "<br>")})
     elif proc.poll():
@@ -211,13 +292,29 @@ while 1:
         print(RESULT_ERROR % {"text": "find-expr killed: Signal %d" % -proc.returncode})
       else:
         print(RESULT_ERROR % {"text": "find-expr died: Return code %d" % proc.returncode})
+    elif save_to and more:
+      # Stopped at the end of the page, with a cursor for the next
+      print(RESULT_NEXT % {
+          "query": urllib.parse.quote(query),
+          "start": start + num,
+          "num": num,
+          "page": start // num + 2,
+        })
     elif rn > 0:
       print(RESULT_DONE)
     else:
       print(RESULT_NONE)
     break
 
+  output = True
   score, text = line.strip().split(" ", 1)
+  if score == "#" and text.startswith("discarded"):
+    continue
+
+  if score == "#" and text == "more":
+    more = True
+    continue
+
   if score == "#" and int(text) >= max_computation:
     print(RESULT_TIMEOUT % {
         "query": urllib.parse.quote(query),
@@ -254,3 +351,7 @@ while 1:
   rn += 1
 
 print(RESULT_PAGE_END)
+sys.stdout.flush()
+
+if cursors:
+  remove_old_cursors()
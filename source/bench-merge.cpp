@@ -0,0 +1,191 @@
+// Time merging sorted indexes (as merge-indexes does) against the number of
+// inputs: the texts of a made-up vocabulary are dealt out among k indexes,
+// each to two of them (as common phrases turn up in most runs), which are
+// then merged with a priority queue comparing whole texts, and with
+// WalkerMerge, for k = 2, 4, 8, ... up to a limit.  Walking the same
+// indexes one after another, with no merging at all, gives the baseline.
+
+#include "index.h"
+
+#include <queue>
+#include <random>
+#include <set>
+#include <string>
+#include <vector>
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+using namespace std;
+
+// Phrases of one to four words, like the chains make-index writes
+static set<string> MakeTexts(size_t count) {
+  mt19937 rng(1);
+  vector<string> words;
+  for (int i = 0; i < 5000; ++i) {
+    string word;
+    for (int len = 2 + rng() % 8; len > 0; --len)
+      word += "etaoinshrdlucmfwyp"[rng() % 18];
+    words.push_back(word);
+  }
+
+  set<string> texts;
+  while (texts.size() < count) {
+    string text;
+    for (int n = 1 + rng() % 4; n > 0; --n) {
+      text += words[min(rng() % words.size(), rng() % words.size())];
+      text += ' ';
+    }
+    texts.insert(text);
+  }
+  return texts;
+}
+
+static IndexReader* WriteIndex(vector<string> const& texts) {
+  FILE* fp = tmpfile();
+  if (fp == NULL) {
+    fprintf(stderr, "error: can't create temporary file\n");
+    exit(1);
+  }
+
+  IndexWriter writer(fp);
+  const char* last = "";
+  for (size_t i = 0; i < texts.size(); ++i) {
+    const char* text = texts[i].c_str();
+    int same = 0;
+    while (last[same] != '\0' && last[same] == text[same]) ++same;
+    writer.next(text, same, 1 + texts[i].size() % 3);
+    last = text;
+  }
+  writer.next(NULL, 0, 0);
+  fflush(fp);
+
+  IndexReader* reader = new IndexReader(fp);
+  fclose(fp);
+  return reader;
+}
+
+static vector<IndexWalker*> Walkers(vector<IndexReader*> const& readers) {
+  vector<IndexWalker*> walkers;
+  for (size_t i = 0; i < readers.size(); ++i)
+    walkers.push_back(
+        new IndexWalker(readers[i], readers[i]->root(), readers[i]->count()));
+  return walkers;
+}
+
+// Each merge returns a sum over its output, to check they agree.
+
+static int64_t Walk(vector<IndexReader*> const& readers) {
+  int64_t sum = 0;
+  vector<IndexWalker*> walkers = Walkers(readers);
+  for (size_t i = 0; i < walkers.size(); ++i) {
+    for (; walkers[i]->text != NULL; walkers[i]->next())
+      sum += walkers[i]->count;
+    delete walkers[i];
+  }
+  return sum;
+}
+
+struct LaterText {
+  bool operator()(IndexWalker* x, IndexWalker* y) const {
+    return strcmp(x->text, y->text) > 0;
+  }
+};
+
+static int64_t MergeQueue(vector<IndexReader*> const& readers) {
+  int64_t sum = 0, order = 0;
+  vector<IndexWalker*> walkers = Walkers(readers);
+  priority_queue<IndexWalker*, vector<IndexWalker*>, LaterText> queue;
+  for (size_t i = 0; i < walkers.size(); ++i) queue.push(walkers[i]);
+  while (!queue.empty()) {
+    IndexWalker* next = queue.top(); queue.pop();
+    sum += next->count * ++order;
+    next->next();
+    if (next->text == NULL)
+      delete next;
+    else
+      queue.push(next);
+  }
+  return sum;
+}
+
+static int64_t MergeTree(vector<IndexReader*> const& readers) {
+  int64_t sum = 0, order = 0;
+  for (WalkerMerge merge(Walkers(readers)); merge.text != NULL; merge.next())
+    sum += merge.count * ++order;
+  return sum;
+}
+
+// The best of a few runs, as the rest are mostly noise
+static double Seconds(int64_t (*run)(vector<IndexReader*> const&),
+                      vector<IndexReader*> const& readers, int64_t* sum) {
+  double best = 0;
+  for (int i = 0; i < 3; ++i) {
+    clock_t start = clock();
+    *sum = run(readers);
+    double time = double(clock() - start) / CLOCKS_PER_SEC;
+    if (i == 0 || time < best) best = time;
+  }
+  return best;
+}
+
+static void usage(char const* argv0) {
+  fprintf(stderr, "usage: %s [-k max_inputs] [-n texts]\n", argv0);
+}
+
+int main(int argc, char *argv[]) {
+  size_t count = 1000000, max_inputs = 256;
+  int opt;
+  while ((opt = getopt(argc, argv, "k:n:")) != -1) {
+    switch (opt) {
+      case 'k': max_inputs = atoi(optarg); break;
+      case 'n': count = atoll(optarg); break;
+      default:
+        usage(argv[0]);
+        return 2;
+    }
+  }
+
+  if (optind != argc || max_inputs < 2 || count < 1) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  set<string> texts = MakeTexts(count);
+  printf("%zu texts (twice each), in millions per second:\n", texts.size());
+  printf("%6s %8s %8s %8s %8s\n", "inputs", "walk", "queue", "tree", "speedup");
+  for (size_t k = 2; k <= max_inputs; k *= 2) {
+    mt19937 rng(k);
+    vector<vector<string> > parts(k);
+    size_t i = 0;
+    for (set<string>::const_iterator it = texts.begin(); it != texts.end();
+         ++it, ++i) {
+      parts[i % k].push_back(*it);
+      parts[(i + 1 + rng() % (k - 1)) % k].push_back(*it);
+    }
+
+    vector<IndexReader*> readers;
+    for (size_t j = 0; j < k; ++j) readers.push_back(WriteIndex(parts[j]));
+
+    int64_t walk_sum, queue_sum, tree_sum;
+    double walk = Seconds(Walk, readers, &walk_sum);
+    double queue = Seconds(MergeQueue, readers, &queue_sum);
+    double tree = Seconds(MergeTree, readers, &tree_sum);
+    if (queue_sum != tree_sum) {
+      fprintf(stderr, "error: merges differ with %zu inputs\n", k);
+      return 1;
+    }
+
+    const double m = 2 * texts.size() / 1e6;
+    printf("%6zu %8.2f %8.2f %8.2f %7.2fx\n",
+           k, m / walk, m / queue, m / tree, queue / tree);
+    fflush(stdout);
+    for (size_t j = 0; j < k; ++j) delete readers[j];
+  }
+
+  return 0;
+}
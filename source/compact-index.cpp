@@ -0,0 +1,159 @@
+// Fold the deltas of an index (name.delta.0.index, ... as IndexShards
+// finds them) into the index itself, writing a new name.index in place of
+// the old one and then removing the deltas.  Searches can go on meanwhile:
+// those already running keep reading the old files, and this runs at low
+// priority so as not to slow them down much.  Deltas added while it runs
+// are kept, renumbered to follow the new index.
+
+#include "index.h"
+
+#include <string>
+#include <vector>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+using namespace std;
+
+static IndexReader* Open(const char* name) {
+  FILE *fp = fopen(name, "rb");
+  if (fp == NULL) return NULL;
+  IndexReader* reader = new IndexReader(fp);
+  fclose(fp);
+  if (!reader->scale().empty()) {
+    fprintf(stderr, "error: \"%s\" has approximate counts\n", name);
+    exit(1);
+  }
+  return reader;
+}
+
+// Renames a file, but not over another (which someone adding a delta might
+// have just written).
+static bool Move(std::string const& from, std::string const& to) {
+  if (link(from.c_str(), to.c_str()) != 0) {
+    fprintf(stderr, "error: can't move \"%s\" to \"%s\": %s\n",
+        from.c_str(), to.c_str(), strerror(errno));
+    return false;
+  }
+  if (unlink(from.c_str()) != 0)
+    fprintf(stderr, "warning: can't remove \"%s\"\n", from.c_str());
+  return true;
+}
+
+static void usage(char const* argv0) {
+  fprintf(stderr, "usage: %s [-c] [-d] [-s span] name.index\n", argv0);
+}
+
+int main(int argc, char *argv[]) {
+  off_t summary_span = 0;
+  bool compact = false, shared = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "cds:")) != -1) {
+    switch (opt) {
+      case 'c': compact = true; break;
+      case 'd': shared = true; break;
+      case 's': summary_span = atoll(optarg); break;
+      default:
+        usage(argv[0]);
+        return 2;
+    }
+  }
+
+  if (optind != argc - 1 || summary_span < 0) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  const char* name = argv[optind];
+  std::vector<IndexReader*> inputs(1, Open(name));
+  if (inputs[0] == NULL) {
+    fprintf(stderr, "error: can't open \"%s\" (sharded indexes can't be "
+        "compacted)\n", name);
+    return 1;
+  }
+
+  std::vector<std::string> deltas;
+  while (IndexReader* delta = Open(
+             IndexShards::delta_name(name, deltas.size()).c_str())) {
+    deltas.push_back(IndexShards::delta_name(name, deltas.size()));
+    inputs.push_back(delta);
+  }
+
+  if (deltas.empty()) {
+    fprintf(stderr, "no deltas for \"%s\"\n", name);
+    return 0;
+  }
+
+  errno = 0;
+  if (nice(10) == -1 && errno != 0) perror("warning: nice");
+
+  std::string temp = std::string(name) + ".new";
+  FILE *out = fopen(temp.c_str(), "wb");
+  if (out == NULL) {
+    fprintf(stderr, "error: can't write \"%s\"\n", temp.c_str());
+    return 1;
+  }
+
+  // As merge-indexes does with the lowest cutoff, 1
+  IndexWriter output(out);
+  output.set_background(true);
+  output.set_summary_span(summary_span);
+  output.set_compact(compact);
+  output.set_shared(shared ? 1 << 20 : 0);
+  FrequencyCutoffWriter writer(&output, 1);
+  std::vector<IndexWalker*> walkers;
+  for (size_t i = 0; i < inputs.size(); ++i)
+    walkers.push_back(
+        new IndexWalker(inputs[i], inputs[i]->root(), inputs[i]->count()));
+  for (WalkerMerge merge(walkers); merge.text != NULL; merge.next())
+    writer.next(merge.text, merge.same, merge.count);
+  writer.next(NULL, 0, 0);
+
+  if (fflush(out) != 0 || fsync(fileno(out)) != 0 || fclose(out) != 0) {
+    fprintf(stderr, "error: can't write \"%s\"\n", temp.c_str());
+    return 1;
+  }
+
+  // IndexShards stops at the first missing delta, so with the first moved
+  // aside, searches opened from here see the old index alone, then the new
+  // one, then each delta added meanwhile as it takes its new number.  They
+  // may miss the newest texts for a moment, but never count any twice.
+  std::vector<std::string> old;
+  for (size_t i = 0; i < deltas.size(); ++i) {
+    old.push_back(deltas[i] + ".old");
+    if (rename(deltas[i].c_str(), old.back().c_str()) != 0) {
+      fprintf(stderr, "error: can't rename \"%s\" to \"%s\"\n",
+          deltas[i].c_str(), old.back().c_str());
+      return 1;
+    }
+
+    if (i == 0 && rename(temp.c_str(), name) != 0) {
+      fprintf(stderr, "error: can't rename \"%s\" to \"%s\"\n",
+          temp.c_str(), name);
+      rename(old.back().c_str(), deltas[i].c_str());
+      return 1;
+    }
+  }
+
+  // Then the deltas added meanwhile take the numbers from 0
+  int later = 0;
+  for (;; ++later) {
+    std::string from = IndexShards::delta_name(name, deltas.size() + later);
+    if (access(from.c_str(), F_OK) != 0) break;
+    if (!Move(from, IndexShards::delta_name(name, later))) return 1;
+  }
+
+  for (size_t i = 0; i < old.size(); ++i) {
+    if (remove(old[i].c_str()) != 0)
+      fprintf(stderr, "warning: can't remove \"%s\"\n", old[i].c_str());
+  }
+
+  for (size_t i = 0; i < inputs.size(); ++i) delete inputs[i];
+  fprintf(stderr, "folded %zu deltas into \"%s\"", deltas.size(), name);
+  if (later > 0) fprintf(stderr, ", kept %d added since", later);
+  fprintf(stderr, "\n");
+  return 0;
+}
@@ -0,0 +1,149 @@
+// Compare the search results from two Nutrimatic index files, such as an
+// exact index and an approximate one (see merge-indexes -q), reporting how
+// far their rankings diverge over a set of queries.
+//
+// Each line of the query file is a simple pattern: letters and digits match
+// themselves, "." matches any letter or digit, and spaces match spaces.
+
+#include "index.h"
+#include "search.h"
+
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+using namespace std;
+
+class PatternFilter: public SearchFilter {
+ public:
+  PatternFilter(char const* pattern): pat(pattern), len(strlen(pattern)) { }
+
+  bool is_accepting(State state) const {
+    assert(state >= 0 && state <= len + 1);
+    return state == len + 1;
+  }
+
+  bool is_state(State state) const {
+    return state >= 0 && state <= len + 1;
+  }
+
+  bool has_transition(State from, char ch, State* to) const {
+    assert(from >= 0 && from <= len + 1);
+    if (from == len + 1) return false;
+    if (from == len) {
+      if (ch != ' ') return false;
+    } else if (pat[from] == '.') {
+      if (!(ch >= 'a' && ch <= 'z') && !(ch >= '0' && ch <= '9')) return false;
+    } else if (pat[from] != ch) {
+      return false;
+    }
+
+    *to = from + 1;
+    return true;
+  }
+
+ private:
+  char const* const pat;
+  const int len;
+};
+
+// The first results of a search, best first.
+static vector<string> Search(IndexShards const& index, char const* pattern,
+                             size_t results, int64_t steps) {
+  PatternFilter filter(pattern);
+  SearchDriver driver(index, &filter, 0, 0.0);
+  vector<string> out;
+  while (driver.steps < steps && out.size() < results) {
+    if (driver.step()) {
+      if (driver.text == NULL) break;
+      out.push_back(driver.text);
+    }
+  }
+  return out;
+}
+
+static void usage(char const* argv0) {
+  fprintf(stderr, "usage: %s [-n results] [-s steps] "
+      "a.index b.index queries.txt\n", argv0);
+}
+
+int main(int argc, char *argv[]) {
+  size_t results = 20;
+  int64_t steps = 1000000;
+  int opt;
+  while ((opt = getopt(argc, argv, "n:s:")) != -1) {
+    switch (opt) {
+      case 'n': results = atoi(optarg); break;
+      case 's': steps = atoll(optarg); break;
+      default:
+        usage(argv[0]);
+        return 2;
+    }
+  }
+
+  if (optind != argc - 3 || results < 2) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  IndexReader::Options options;
+  if (!options.parse_environment()) return 2;
+
+  IndexShards a(argv[optind], options), b(argv[optind + 1], options);
+  FILE *fq = fopen(argv[optind + 2], "r");
+  if (fq == NULL) {
+    fprintf(stderr, "error: can't open \"%s\"\n", argv[optind + 2]);
+    return 1;
+  }
+  int queries = 0, identical = 0;
+  double overlap_sum = 0, tau_sum = 0;
+  char line[1024];
+  while (fgets(line, sizeof(line), fq) != NULL) {
+    line[strcspn(line, "\n")] = '\0';
+    if (line[0] == '\0') continue;
+
+    vector<string> ra = Search(a, line, results, steps);
+    vector<string> rb = Search(b, line, results, steps);
+    map<string, int> rank_b;
+    for (size_t i = 0; i < rb.size(); ++i) rank_b[rb[i]] = i;
+
+    // The results in both lists, and how many pairs of those are in the
+    // same order in each (Kendall's tau)
+    vector<int> common;
+    size_t same = 0;
+    while (same < ra.size() && same < rb.size() && ra[same] == rb[same])
+      ++same;
+    for (size_t i = 0; i < ra.size(); ++i) {
+      map<string, int>::const_iterator it = rank_b.find(ra[i]);
+      if (it != rank_b.end()) common.push_back(it->second);
+    }
+
+    int64_t pairs = 0, agree = 0;
+    for (size_t i = 0; i < common.size(); ++i)
+      for (size_t j = i + 1; j < common.size(); ++j, ++pairs)
+        agree += (common[i] < common[j]) ? 1 : -1;
+
+    size_t most = max(ra.size(), rb.size());
+    double overlap = most ? double(common.size()) / most : 1.0;
+    double tau = pairs ? double(agree) / pairs : 1.0;
+    printf("%.3f overlap, %.3f tau, same through %zu: %s\n",
+        overlap, tau, same, line);
+
+    ++queries;
+    overlap_sum += overlap;
+    tau_sum += tau;
+    if (same == most) ++identical;
+  }
+
+  if (queries > 0)
+    printf("# %d queries: %.3f mean overlap, %.3f mean tau, %d identical\n",
+        queries, overlap_sum / queries, tau_sum / queries, identical);
+  return 0;
+}
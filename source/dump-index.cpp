@@ -19,6 +19,12 @@ int main(int argc, char *argv[]) {
   }
 
   IndexReader reader(fp);
+  if (!reader.scale().empty()) {
+    fprintf(stderr, "error: \"%s\" has approximate counts, which can't be "
+        "walked\n", argv[1]);
+    return 1;
+  }
+
   IndexWalker walker(&reader, reader.root(), reader.count());
   while (walker.text != NULL) {
     printf("%5" PRId64 " [%s]\n", walker.count, walker.text);
@@ -58,6 +58,13 @@ int main(int argc, char *argv[]) {
 
   printf("Root (%" PRId64 ") @%lld\n", reader.count(),
       static_cast<long long>(reader.root()));
+  if (!reader.scale().empty()) printf("Counts: approximate\n");
+  for (int i = 0; i < 16; ++i) {
+    if (reader.nodes(i) == 0) continue;
+    printf("Nodes %s%02X: %" PRId64 "\n",
+        i < 8 ? "" : i == 9 ? "varint " : "bitmap ", (i & 7) << 5,
+        reader.nodes(i));
+  }
 
   int depth = strlen(argv[2]);
   if (argc > 3) {
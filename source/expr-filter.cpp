@@ -6,6 +6,10 @@
 
 #include <assert.h>
 
+#include <algorithm>
+#include <utility>
+#include <vector>
+
 using namespace fst;
 
 ExprFilter::ExprFilter(StdFst const& raw) {
@@ -19,6 +23,7 @@ ExprFilter::ExprFilter(StdFst const& raw) {
     accepting.resize(1, false);
     for (int c = 0; c <= UCHAR_MAX; ++c) next[c].resize(1, -1);
     start_state = 0;
+    plan();
     return;
   }
 
@@ -38,4 +43,96 @@ ExprFilter::ExprFilter(StdFst const& raw) {
       next[arc.ilabel][s] = arc.nextstate;
     }
   }
+
+  plan();
+}
+
+// Letters (other than space) from each state to the nearest target state,
+// not using letters with the given bit (if it isn't -1); -1 where no target
+// can be reached.
+static void Distances(std::vector<bool> const& target,
+                      std::vector<std::vector<std::pair<int, int> > > const& in,
+                      int skip_bit, std::vector<int>* out) {
+  out->assign(target.size(), -1);
+  std::vector<int> queue;
+  for (size_t s = 0; s < target.size(); ++s)
+    if (target[s]) { (*out)[s] = 0; queue.push_back(s); }
+
+  for (size_t i = 0; i < queue.size(); ++i) {
+    int to = queue[i];
+    for (size_t j = 0; j < in[to].size(); ++j) {
+      int from = in[to][j].first;
+      if ((*out)[from] >= 0) continue;
+      if (skip_bit >= 0 &&
+          IndexReader::letter_bit(in[to][j].second) == skip_bit)
+        continue;
+      (*out)[from] = (*out)[to] + 1;
+      queue.push_back(from);
+    }
+  }
+}
+
+void ExprFilter::plan() {
+  static const int most = 0xFF;
+  const size_t num = accepting.size();
+
+  // Transitions into each state, other than on space.
+  std::vector<std::vector<std::pair<int, int> > > in(num);
+  uint64_t used = 0;
+  for (int c = 0; c <= UCHAR_MAX; ++c) {
+    if (c == ' ') continue;
+    for (size_t s = 0; s < num; ++s) {
+      if (next[c][s] < 0) continue;
+      in[next[c][s]].push_back(std::make_pair(int(s), c));
+      int bit = IndexReader::letter_bit(c);
+      if (bit >= 0) used |= uint64_t(1) << bit;
+    }
+  }
+
+  std::vector<bool> spacing(num), target(num);
+  for (size_t s = 0; s < num; ++s) {
+    spacing[s] = next[(unsigned char) ' '][s] >= 0;
+    target[s] = spacing[s] || accepting[s];
+  }
+
+  std::vector<int> dist;
+  accept_min.assign(num, most);
+  Distances(accepting, in, -1, &dist);
+  for (size_t s = 0; s < num; ++s)
+    if (dist[s] >= 0) accept_min[s] = std::min(dist[s], most);
+
+  space_min.assign(num, most);
+  space_max.assign(num, 0);
+  Distances(spacing, in, -1, &dist);
+  for (size_t s = 0; s < num; ++s) {
+    if (dist[s] < 0) continue;
+    space_min[s] = space_max[s] = std::min(dist[s], most);
+  }
+
+  // Relax longest paths until nothing changes; around a cycle they keep
+  // growing until they saturate.
+  for (bool changed = true; changed; ) {
+    changed = false;
+    for (size_t to = 0; to < num; ++to) {
+      if (dist[to] < 0) continue;
+      for (size_t j = 0; j < in[to].size(); ++j) {
+        int from = in[to][j].first;
+        int length = std::min(space_max[to] + 1, most);
+        if (length > space_max[from]) {
+          space_max[from] = length;
+          changed = true;
+        }
+      }
+    }
+  }
+
+  needed.assign(num, 0);
+  Distances(target, in, -1, &dist);
+  std::vector<int> without;
+  for (int bit = 0; bit < 64; ++bit) {
+    if (!(used & (uint64_t(1) << bit))) continue;
+    Distances(target, in, bit, &without);
+    for (size_t s = 0; s < num; ++s)
+      if (dist[s] >= 0 && without[s] < 0) needed[s] |= uint64_t(1) << bit;
+  }
 }
@@ -29,14 +29,33 @@ class ExprFilter: public SearchFilter {
     return accepting[state];
   }
 
+  bool is_state(State state) const {
+    return state >= 0 && state < State(accepting.size());
+  }
+
   bool has_transition(State from, char ch, State *to) const {
     assert(from >= 0 && from < accepting.size());
     *to = next[(unsigned char) ch][from];
     return *to >= 0;
   }
 
+  bool may_match(State state, IndexReader::Summary const& summary) const {
+    assert(state >= 0 && state < accepting.size());
+    if (needed[state] & ~summary.letters) return false;
+    if (accept_min[state] <= summary.max) return true;
+    return space_min[state] <= summary.max && space_max[state] >= summary.min;
+  }
+
  private:
   State start_state;
   std::vector<bool> accepting;
   std::vector<State> next[UCHAR_MAX + 1];
+
+  // Per state, counting letters other than space (saturating at 0xFF):
+  // fewest to reach acceptance, fewest and most to reach a state that can
+  // take a space, and the letters (as IndexReader::letter_bit) that every
+  // path to either must use.  Filled in by plan().
+  std::vector<int> accept_min, space_min, space_max;
+  std::vector<uint64_t> needed;
+  void plan();
 };
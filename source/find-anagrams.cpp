@@ -5,6 +5,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 class AnagramFilter: public SearchFilter {
  public:
@@ -32,6 +33,12 @@ class AnagramFilter: public SearchFilter {
     return (state == product);
   }
 
+  // (Letters after the accepting state count up from it again, so there
+  // are twice as many states as combinations of letters.)
+  bool is_state(State state) const {
+    return state >= 0 && state - product < product;
+  }
+
   bool has_transition(State from, char ch, State* to) const {
     if (ch == ' ') {
       *to = (from == product - 1) ? product : from;
@@ -54,21 +61,18 @@ class AnagramFilter: public SearchFilter {
   State product;
 };
 
+static void usage(char const* argv0) {
+  fprintf(stderr, "usage: %s [-b beam] [-t threads] [-s slack] [-r cursor] "
+      "[-n count [-w cursor [-W bytes]]] input.index letters\n", argv0);
+}
+
 int main(int argc, char *argv[]) {
-  if (argc != 3) {
-    fprintf(stderr, "usage: %s input.index letters\n", argv[0]);
+  SearchOptions options;
+  if (!options.parse(argc, argv) || optind != argc - 2) {
+    usage(argv[0]);
     return 2;
   }
 
-  FILE *fp = fopen(argv[1], "rb");
-  if (fp == NULL) {
-    fprintf(stderr, "error: can't open \"%s\"\n", argv[1]);
-    return 1;
-  }
-
-  IndexReader reader(fp);
-  AnagramFilter filter(argv[2]);
-  SearchDriver driver(&reader, &filter, 0, 1e-6);
-  PrintAll(&driver);
-  return 0;
+  AnagramFilter filter(argv[optind + 1]);
+  return RunSearch(options, argv[optind], &filter, 0, argv[optind + 1]);
 }
@@ -5,14 +5,24 @@
 #include "fst/concat.h"
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
 
 using namespace fst;
 
+static void usage(char const* argv0) {
+  fprintf(stderr, "usage: %s [-b beam] [-t threads] [-s slack] [-r cursor] "
+      "[-n count [-w cursor [-W bytes]]] input.index expression\n", argv0);
+}
+
 int main(int argc, char *argv[]) {
-  if (argc != 3 || strlen(argv[2]) == 0) {
-    fprintf(stderr, "usage: %s input.index expression\n", argv[0]);
+  SearchOptions options;
+  if (!options.parse(argc, argv) || optind != argc - 2 ||
+      strlen(argv[optind + 1]) == 0) {
+    usage(argv[0]);
     return 2;
   }
+  const char* expr = argv[optind + 1];
 
   SymbolTable *chars = new SymbolTable("chars");
   chars->AddSymbol("epsilon", 0);
@@ -24,9 +34,9 @@ int main(int argc, char *argv[]) {
   parsed.SetInputSymbols(chars);
   parsed.SetOutputSymbols(chars);
 
-  const char *p = ParseExpr(argv[2], &parsed, false);
+  const char *p = ParseExpr(expr, &parsed, false);
   if (p == NULL || *p != '\0') {
-    fprintf(stderr, "error: can't parse \"%s\"\n", p ? p : argv[2]);
+    fprintf(stderr, "error: can't parse \"%s\"\n", p ? p : expr);
     return 2;
   }
 
@@ -35,15 +45,6 @@ int main(int argc, char *argv[]) {
   ParseExpr(" ", &space, true);
   Concat(&parsed, space);
 
-  FILE *fp = fopen(argv[1], "rb");
-  if (fp == NULL) {
-    fprintf(stderr, "error: can't open \"%s\"\n", argv[1]);
-    return 1;
-  }
-
   ExprFilter filter(parsed);
-  IndexReader reader(fp);
-  SearchDriver driver(&reader, &filter, filter.start(), 1e-6);
-  PrintAll(&driver);
-  return 0;
+  return RunSearch(options, argv[optind], &filter, filter.start(), expr);
 }
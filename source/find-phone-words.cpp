@@ -3,7 +3,9 @@
 
 #include <assert.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 class PhoneFilter: public SearchFilter {
  public:
@@ -14,6 +16,10 @@ class PhoneFilter: public SearchFilter {
     return state == len + 1;
   }
 
+  bool is_state(State state) const {
+    return state >= 0 && state <= len + 1;
+  }
+
   bool has_transition(State from, char ch, State* to) const {
     assert(from >= 0 && from <= len + 1);
     if (from == len + 1) return false;
@@ -73,21 +79,18 @@ class PhoneFilter: public SearchFilter {
   const int len;
 };
 
+static void usage(char const* argv0) {
+  fprintf(stderr, "usage: %s [-b beam] [-t threads] [-s slack] [-r cursor] "
+      "[-n count [-w cursor [-W bytes]]] input.index digits\n", argv0);
+}
+
 int main(int argc, char *argv[]) {
-  if (argc != 3) {
-    fprintf(stderr, "usage: %s input.index digits\n", argv[0]);
+  SearchOptions options;
+  if (!options.parse(argc, argv) || optind != argc - 2) {
+    usage(argv[0]);
     return 2;
   }
 
-  FILE *fp = fopen(argv[1], "rb");
-  if (fp == NULL) {
-    fprintf(stderr, "error: can't open \"%s\"\n", argv[1]);
-    return 1;
-  }
-
-  IndexReader reader(fp);
-  PhoneFilter filter(argv[2]);
-  SearchDriver driver(&reader, &filter, 0, 1e-6);
-  PrintAll(&driver);
-  return 0;
+  PhoneFilter filter(argv[optind + 1]);
+  return RunSearch(options, argv[optind], &filter, 0, argv[optind + 1]);
 }
@@ -0,0 +1,141 @@
+#include "index.h"
+
+#include <assert.h>
+#include <limits.h>
+#include <string.h>
+
+#include <algorithm>
+
+using namespace std;
+
+#define DEBUG 0
+
+FrequencyCutoffWriter::FrequencyCutoffWriter(IndexWriter* out, int min):
+    output(out), cutoff(min), output_same(0) {
+  words.push_back(make_pair(0, 0));
+}
+
+void FrequencyCutoffWriter::next(const char *text, int same, int64_t count) {
+  add(text, same, count);
+  if (text == NULL) output->next(NULL, 0, 0);
+}
+
+void FrequencyCutoffWriter::end_part() {
+  add(NULL, 0, 0);
+  output->end_part();
+}
+
+void FrequencyCutoffWriter::add(const char *text, int same, int64_t count) {
+  if (text != NULL) {
+    assert(same <= int(saved.size()));
+    assert(memcmp(saved.c_str(), text, same) == 0);
+    assert(same == int(saved.size()) || text[same] != saved[same]);
+    assert(strcmp(saved.c_str() + same, text + same) <= 0);
+#if DEBUG
+    fprintf(stderr, "input: [%.*s|%s] * %d\n", same, text, text+same, count);
+#endif
+  }
+
+  assert(!words.empty());
+  while (words.back().first > (size_t) same) {
+    pair<size_t, int64_t> last_word = words.back();
+    words.pop_back();
+
+    assert(saved.size() >= last_word.first);
+    saved.resize(last_word.first);
+    output_same = min(output_same, saved.size());
+    if (last_word.second >= cutoff ||
+        (last_word.second > 0 && output_same == last_word.first)) {
+#if DEBUG
+      fprintf(stderr, "output: [%.*s|%s] * %d\n",
+          output_same, saved.c_str(),
+          saved.c_str()+output_same, last_word.second);
+#endif
+      output->next(saved.c_str(), output_same, last_word.second);
+      output_same = words.back().first;
+    } else {
+      words.back().second += last_word.second;
+      output_same = min(output_same, words.back().first);
+    }
+  }
+
+  saved.resize(same);
+  if (text != NULL) {
+    saved.append(text + same);
+    while (const char *space = strchr(text + same, ' ')) {
+      same = space - text + 1;
+      words.push_back(make_pair(same, 0));
+    }
+  }
+
+  if (!words.empty()) words.back().second += count;
+}
+
+// As with FrequencyCutoffWriter, a word (a text ending in a space) is kept
+// if its count, with that of any words folded into it, reaches the cutoff,
+// or if it has any count at all and some longer word starting with it is
+// kept.  Otherwise its count folds into the longest word that it starts
+// with.  Kept words are written after the words they start, in the order
+// the cutoff writer writes them.
+IndexPruner::IndexPruner(const IndexReader* in, IndexWriter* out,
+                         int64_t min):
+    input(in), output(out), cutoff(min), skipped(0) {}
+
+void IndexPruner::run() {
+  int64_t dropped = 0;  // Texts with no space go nowhere.
+  if (input->root() != -1) visit(input->root(), input->count(), &dropped);
+  output->next(NULL, 0, 0);
+}
+
+// Writes the kept words below a node, whose text is in text; adds what
+// folds into the word at or above it to *fold, and returns true if any
+// word was kept.
+bool IndexPruner::visit(IndexReader::Node node, int64_t count,
+                        int64_t* fold) {
+  IndexReader::Cursor cursor;
+  input->cursor(node, count, CHAR_MIN, CHAR_MAX, &cursor);
+  bool kept = false;
+  while (cursor.next()) {
+    IndexReader::Choice const choice = cursor.choice;
+    if (choice.count < cutoff) {
+      *fold += choice.count;
+      ++skipped;
+      continue;
+    }
+
+    text.push_back(choice.ch);
+    if (choice.ch == ' ')
+      kept = word(choice, fold) || kept;
+    else if (choice.next == -1)
+      *fold += choice.count;
+    else
+      kept = visit(choice.next, choice.count, fold) || kept;
+    text.pop_back();
+  }
+
+  *fold += cursor.count;  // Texts ending at this node
+  return kept;
+}
+
+// Handles the word in text (the last letter of which is this choice), as
+// visit() does, but folding into the word itself, which is then kept or
+// folded in turn.
+bool IndexPruner::word(IndexReader::Choice const& choice, int64_t* fold) {
+  int64_t own = choice.count;
+  bool below = false;
+  if (choice.next != -1) {
+    own = 0;
+    below = visit(choice.next, choice.count, &own);
+  }
+
+  if (own < cutoff && (own == 0 || !below)) {
+    *fold += own;
+    return below;
+  }
+
+  size_t same = 0;
+  while (same < last.size() && last[same] == text[same]) ++same;
+  output->next(text.c_str(), same, own);
+  last = text;
+  return true;
+}
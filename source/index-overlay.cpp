@@ -0,0 +1,183 @@
+#include "index.h"
+
+#include <assert.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <algorithm>
+
+using namespace std;
+
+// Node numbers: a node of one index is its position and the index's number
+// times two; a run of parts is its number times two plus one.
+static const int MAX_SEGMENTS = 256;
+
+IndexOverlay::IndexOverlay(std::vector<const IndexReader*> const& s):
+    segments(s), root_node(-1), total(0) {
+  if (segments.size() > size_t(MAX_SEGMENTS)) {
+    fprintf(stderr, "error: can't overlay %zu indexes (at most %d)\n",
+        segments.size(), MAX_SEGMENTS);
+    exit(1);
+  }
+
+  std::vector<Part> roots;
+  for (size_t i = 0; i < segments.size(); ++i) {
+    total += segments[i]->count();
+    if (segments[i]->root() == -1) continue;
+    Part part = { int(i), segments[i]->root(), segments[i]->count() };
+    roots.push_back(part);
+  }
+
+  if (roots.size() == 1)
+    root_node = single(roots[0].segment, roots[0].node);
+  else if (!roots.empty())
+    root_node = number(&roots[0], &roots[0] + roots.size());
+}
+
+IndexOverlay::Node IndexOverlay::single(int segment,
+                                        IndexReader::Node node) const {
+  return node == -1 ? -1 : (node * MAX_SEGMENTS + segment) * 2;
+}
+
+IndexOverlay::Node IndexOverlay::number(Part const* begin,
+                                        Part const* end) const {
+  std::string key;
+  for (Part const* part = begin; part != end; ++part) {
+    key.push_back(part->segment);
+    key.append((const char*) &part->node, sizeof(part->node));
+    key.append((const char*) &part->count, sizeof(part->count));
+  }
+
+  unordered_map<std::string, Node>::const_iterator it = numbers.find(key);
+  if (it != numbers.end()) return it->second;
+
+  Node node = runs.size() * 2 + 1;
+  Run run = { parts.size(), size_t(end - begin), false, 0,
+              std::vector<IndexReader::Choice>() };
+  runs.push_back(run);
+  parts.insert(parts.end(), begin, end);
+  numbers[key] = node;
+  return node;
+}
+
+void IndexOverlay::expand(Node node, int64_t count, Part* one,
+                          Part const** begin, Part const** end) const {
+  if (node % 2 == 0) {
+    one->segment = (node / 2) % MAX_SEGMENTS;
+    one->node = (node / 2) / MAX_SEGMENTS;
+    one->count = count;
+    *begin = one;
+    *end = one + 1;
+  } else {
+    assert(size_t(node / 2) < runs.size());
+    Run const& run = runs[node / 2];
+    *begin = &parts[run.first];
+    *end = *begin + run.size;
+  }
+}
+
+static bool by_letter(pair<IndexReader::Choice, int> const& a,
+                      pair<IndexReader::Choice, int> const& b) {
+  if (a.first.ch != b.first.ch)
+    return (unsigned char) a.first.ch < (unsigned char) b.first.ch;
+  return a.second < b.second;
+}
+
+int64_t IndexOverlay::children(Node parent, int64_t count, char min, char max,
+                               std::vector<IndexReader::Choice>* out) const {
+  if (parent == -1) return count;
+
+  Part one;
+  Part const *begin, *end;
+  expand(parent, count, &one, &begin, &end);
+  if (end - begin == 1) {
+    // Just one index, so just renumber its children
+    size_t first = out->size();
+    int64_t rest = segments[begin->segment]->children(
+        begin->node, begin->count, min, max, out);
+    for (size_t i = first; i < out->size(); ++i)
+      (*out)[i].next = single(begin->segment, (*out)[i].next);
+    return rest;
+  }
+
+  if (min != CHAR_MIN || max != CHAR_MAX)
+    return merge(begin, end, count, min, max, out);
+
+  Run* run = &runs[parent / 2];
+  if (!run->merged) {
+    std::vector<IndexReader::Choice> choices;
+    int64_t rest = merge(begin, end, count, min, max, &choices);
+    run = &runs[parent / 2];  // merge() may add runs
+    run->rest = rest;
+    run->choices.swap(choices);
+    run->merged = true;
+  }
+
+  out->insert(out->end(), run->choices.begin(), run->choices.end());
+  return run->rest;
+}
+
+// Gathers every index's children, then adds up those with the same letter.
+int64_t IndexOverlay::merge(Part const* begin, Part const* end, int64_t count,
+                            char min, char max,
+                            std::vector<IndexReader::Choice>* out) const {
+  scratch.clear();
+  for (Part const* part = begin; part != end; ++part) {
+    IndexReader::Cursor cursor;
+    segments[part->segment]->cursor(part->node, part->count, min, max, &cursor);
+    while (cursor.next())
+      scratch.push_back(make_pair(cursor.choice, part->segment));
+  }
+  sort(scratch.begin(), scratch.end(), by_letter);
+
+  std::vector<Part> below;
+  for (size_t i = 0; i < scratch.size();) {
+    IndexReader::Choice choice = scratch[i].first;
+    choice.count = 0;
+    below.clear();
+    for (; i < scratch.size() && scratch[i].first.ch == choice.ch; ++i) {
+      IndexReader::Choice const& c = scratch[i].first;
+      choice.count += c.count;
+      if (c.next == -1) continue;
+      Part part = { scratch[i].second, c.next, c.count };
+      below.push_back(part);
+    }
+
+    if (below.empty())
+      choice.next = -1;
+    else if (below.size() == 1)
+      choice.next = single(below[0].segment, below[0].node);
+    else
+      choice.next = number(&below[0], &below[0] + below.size());
+
+    count -= choice.count;
+    out->push_back(choice);
+  }
+
+  return count;
+}
+
+bool IndexOverlay::summary(Node node, int64_t count,
+                           IndexReader::Summary* out) const {
+  if (node == -1) return false;
+
+  Part one;
+  Part const *begin, *end;
+  expand(node, count, &one, &begin, &end);
+  for (Part const* part = begin; part != end; ++part) {
+    IndexReader::Cursor cursor;
+    segments[part->segment]->cursor(part->node, part->count,
+                                    CHAR_MIN, CHAR_MAX, &cursor);
+    if (!cursor.summarized) return false;
+    if (part == begin) {
+      *out = cursor.summary;
+    } else {
+      out->min = std::min(out->min, cursor.summary.min);
+      out->max = std::max(out->max, cursor.summary.max);
+      out->letters |= cursor.summary.letters;
+    }
+  }
+
+  return true;
+}
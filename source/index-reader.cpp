@@ -2,63 +2,494 @@
 
 #include <assert.h>
 #include <limits.h>
+#include <stdlib.h>
+#include <string.h>
 #include <sys/mman.h>
+#include <sys/resource.h>
+#include <time.h>
 
 #include <algorithm>
+#include <string>
 
 using namespace std;
 
-IndexReader::IndexReader(FILE* fp) {
+const char IndexReader::TRAILER_MAGIC[8] = {
+  'N', 'U', 'T', 'R', 'I', 'D', 'X', '\0'
+};
+
+static uint64_t get(const unsigned char* p, int size) {
+  uint64_t value = 0;
+  for (int j = 0; j < size; ++j) value |= (uint64_t)(p[j]) << (j * 8);
+  return value;
+}
+
+uint64_t IndexReader::checksum(const unsigned char* p, size_t size) {
+  uint64_t hash = 0xcbf29ce484222325ULL;
+  for (size_t i = 0; i < size; ++i)
+    hash = (hash ^ p[i]) * 0x100000001b3ULL;
+  return hash;
+}
+
+IndexReader::IndexReader(FILE* fp, Options const& options):
+    cache_choices(NULL) {
   // open the file
   fseek(fp, 0, SEEK_END);
   length = ftell(fp);
-  void* map = mmap(NULL, length, PROT_READ, MAP_SHARED, fileno(fp), 0);
+  int flags = MAP_SHARED;
+  if (options.populate >= size_t(length)) flags |= MAP_POPULATE;
+  void* map = mmap(NULL, length, PROT_READ, flags, fileno(fp), 0);
   data = (const unsigned char*) map;
   if (map == MAP_FAILED) {
     fprintf(stderr, "error: can't mmap data file (length %zu)\n", length);
     exit(1);
   }
 
-  // scan the top level nodes to compute the total
-  std::vector<Choice> top;
-  children(root(), 0, CHAR_MIN, CHAR_MAX, &top);
-  while (top.size() == 1 && top[0].count == 0) {
-    off_t node = top[0].next;
-    top.clear();
-    children(node, 0, CHAR_MIN, CHAR_MAX, &top);
+  if (options.populate > 0 && options.populate < size_t(length)) {
+    // map the prefix again in place, this time populating it
+    map = mmap(map, options.populate, PROT_READ, MAP_SHARED | MAP_FIXED |
+               MAP_POPULATE, fileno(fp), 0);
+    if (map == MAP_FAILED) {
+      fprintf(stderr, "error: can't populate data file prefix\n");
+      exit(1);
+    }
+  }
+
+  advise(options);
+
+  if (!read_trailer()) {
+    // no trailer: scan the top level nodes to compute the total
+    root_pos = length;
+    format = 0;
+    for (int i = 0; i < 16; ++i) node_counts[i] = 0;
+    const ssize_t tail = min<ssize_t>(length, 4096);
+    print = checksum(data + length - tail, tail);
+
+    std::vector<Choice> top;
+    children(root(), 0, CHAR_MIN, CHAR_MAX, &top);
+    while (top.size() == 1 && top[0].count == 0) {
+      off_t node = top[0].next;
+      top.clear();
+      children(node, 0, CHAR_MIN, CHAR_MAX, &top);
+    }
+
+    total = 0;
+    for (size_t i = 0; i < top.size(); ++i) total += top[i].count;
+  }
+
+  if (options.warm_depth > 0) warm(options.warm_depth);
+  if (options.cache_depth > 0)
+    build_cache(options.cache_depth, options.cache_bytes);
+}
+
+void IndexReader::advise(Options const& options) {
+  memset(&stats, 0, sizeof(stats));
+  if (options.advice >= 0)
+    stats.advice_failed = madvise((void*) data, length, options.advice) != 0;
+  if (options.hugepages)
+    stats.hugepages_failed =
+        madvise((void*) data, length, MADV_HUGEPAGE) != 0;
+
+  if (options.lock > 0) {
+    long page = sysconf(_SC_PAGESIZE);
+    off_t start = max<off_t>(length - off_t(options.lock), 0) / page * page;
+    stats.lock_failed = mlock(data + start, length - start) != 0;
+  }
+}
+
+static double now() {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static int64_t major_faults() {
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_majflt;
+}
+
+int64_t IndexReader::resident() const {
+  long page = sysconf(_SC_PAGESIZE);
+  std::vector<unsigned char> pages((length + page - 1) / page);
+  if (mincore((void*) data, length, &pages[0]) != 0) return -1;
+  int64_t count = 0;
+  for (size_t i = 0; i < pages.size(); ++i) count += pages[i] & 1;
+  return count;
+}
+
+void IndexReader::warm(int depth) {
+  // read every node down to the depth, breadth first, so its pages load
+  double start = now();
+  int64_t faults = major_faults();
+  stats.resident_before = resident();
+
+  std::vector<Node> level(1, root()), below;
+  for (int d = 0; d < depth && !level.empty(); ++d) {
+    below.clear();
+    for (size_t i = 0; i < level.size(); ++i) {
+      Cursor c;
+      cursor(level[i], 0, CHAR_MIN, CHAR_MAX, &c);
+      if (c.kind != Cursor::EMPTY) ++stats.warm_nodes;
+      while (c.next()) below.push_back(c.choice.next);
+    }
+    level.swap(below);
   }
 
-  total = 0;
-  for (size_t i = 0; i < top.size(); ++i) total += top[i].count;
+  stats.resident_after = resident();
+  stats.warm_faults = major_faults() - faults;
+  stats.warm_seconds = now() - start;
+}
+
+bool IndexReader::Options::parse(const char* spec) {
+  while (spec != NULL && *spec != '\0') {
+    size_t len = strcspn(spec, ",");
+    std::string name(spec, len), value;
+    spec += len + (spec[len] == ',' ? 1 : 0);
+
+    size_t equals = name.find('=');
+    if (equals == std::string::npos) return false;
+    value = name.substr(equals + 1);
+    name.resize(equals);
+
+    if (name == "advice") {
+      if (value == "normal") advice = MADV_NORMAL;
+      else if (value == "random") advice = MADV_RANDOM;
+      else if (value == "sequential") advice = MADV_SEQUENTIAL;
+      else return false;
+      continue;
+    }
+
+    char* end;
+    long long number = strtoll(value.c_str(), &end, 10);
+    switch (*end) {
+      case 'G': number <<= 10;  // fall through
+      case 'M': number <<= 10;  // fall through
+      case 'K': number <<= 10; ++end;
+    }
+    if (value.empty() || *end != '\0' || number < 0) return false;
+
+    if (name == "cache-depth") {
+      cache_depth = number;
+    } else if (name == "cache-bytes") {
+      cache_bytes = number;
+    } else if (name == "populate") {
+      populate = number;
+    } else if (name == "hugepages") {
+      hugepages = (number != 0);
+    } else if (name == "lock") {
+      lock = number;
+    } else if (name == "warm") {
+      warm_depth = number;
+    } else {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+bool IndexReader::Options::parse_environment() {
+  const char* spec = getenv("NUTRIMATIC_READER");
+  cache_depth = 3;
+  if (parse(spec)) return true;
+  fprintf(stderr, "error: bad $NUTRIMATIC_READER \"%s\"\n", spec);
+  return false;
+}
+
+void IndexReader::build_cache(int depth, size_t bytes) {
+  // decode breadth first until the depth or the memory budget runs out
+  std::vector<Choice> choices;
+  std::vector<Node> level(1, root()), below;
+  for (int d = 0; d < depth && !level.empty(); ++d) {
+    below.clear();
+    for (size_t i = 0; i < level.size(); ++i) {
+      Cursor c;
+      cursor(level[i], 0, CHAR_MIN, CHAR_MAX, &c);
+      if (c.kind == Cursor::EMPTY) continue;
+      if (c.kind == Cursor::LETTER) {  // cheap to decode anyway
+        below.push_back(c.choice.next);
+        continue;
+      }
+
+      Cached node;
+      node.node = level[i];
+      node.sum = c.sum();
+      node.first = choices.size();
+      node.summarized = c.summarized;
+      node.summary = c.summary;
+      while (c.next()) {
+        choices.push_back(c.choice);
+        below.push_back(c.choice.next);
+      }
+
+      node.num = choices.size() - node.first;
+      if (choices.size() * sizeof(Choice) +
+          (cached.size() + 1) * (sizeof(Cached) + 2 * sizeof(int)) > bytes) {
+        choices.resize(node.first);
+        below.clear();
+        break;
+      }
+
+      cached.push_back(node);
+    }
+    level.swap(below);
+  }
+
+  if (cached.empty()) return;
+
+  void* memory;
+  if (posix_memalign(&memory, 64, choices.size() * sizeof(Choice)) != 0) {
+    fprintf(stderr, "error: can't allocate index cache\n");
+    exit(1);
+  }
+  cache_choices = (Choice*) memory;
+  copy(choices.begin(), choices.end(), cache_choices);
+
+  size_t slots = 1;
+  while (slots < 2 * cached.size()) slots *= 2;
+  cache_slots.assign(slots, -1);
+  for (size_t i = 0; i < cached.size(); ++i) {
+    size_t slot = cache_slot(cached[i].node);
+    if (cache_slots[slot] < 0) cache_slots[slot] = i;
+  }
+}
+
+static bool letter_before(IndexReader::Choice const& choice, char ch) {
+  return choice.ch < ch;
+}
+
+size_t IndexReader::cache_slot(Node n) const {
+  size_t mask = cache_slots.size() - 1;
+  size_t slot = (uint64_t(n) * 0x9E3779B97F4A7C15ULL >> 32) & mask;
+  while (cache_slots[slot] >= 0 && cached[cache_slots[slot]].node != n)
+    slot = (slot + 1) & mask;
+  return slot;
+}
+
+bool IndexReader::read_trailer() {
+  if (length < TRAILER_SIZE) return false;
+  const unsigned char* end = data + length;
+  if (memcmp(end - 8, TRAILER_MAGIC, 8)) return false;
+
+  ssize_t size = get(end - 20, 4);
+  if (size < TRAILER_SIZE || size > length) return false;
+  print = get(end - 16, 8);
+  if (print != checksum(end - size, size - 16)) return false;
+
+  const unsigned char* p = end - size;
+  format = get(end - 24, 4);
+  if (format < 1) return false;
+  if (format > TRAILER_VERSION) {
+    fprintf(stderr, "error: unknown index version %d\n", format);
+    exit(1);
+  }
+
+  root_pos = get(p, 8);
+  total = get(p + 8, 8);
+  for (int i = 0; i < 16; ++i) node_counts[i] = get(p + 16 + i * 8, 8);
+  if (format >= 2) {
+    if (size != TRAILER_SIZE + 256 * 8) fail(length - size, "bad trailer");
+    scale_table.resize(256);
+    for (int i = 0; i < 256; ++i) scale_table[i] = get(p + 144 + i * 8, 8);
+  }
+  if (root_pos != (Node) -1 && (root_pos < 1 || root_pos > length - size))
+    fail(length - size, "bad root");
+  return true;
 }
 
 IndexReader::~IndexReader() {
   munmap((void*) data, length);
+  free(cache_choices);
 }
 
-int IndexReader::children(off_t n, int64_t count,
-                          char min, char max,
-                          std::vector<Choice>* out) const {
-  if (n == (off_t) -1) return count;
+// Number of bitmap letters that sort before ch.
+static int bits_below(int ch) {
+  return (ch <= 0x20) ? 0 : (ch <= 0x40) ? ch - 0x20 :
+         (ch <= 0x60) ? 0x20 : (ch <= 0x80) ? ch - 0x40 : 0x40;
+}
+
+static int bit_letter(int bit) {
+  return (bit < 0x20) ? bit + 0x20 : bit + 0x40;
+}
+
+int64_t IndexReader::get_count(off_t p, int count_size) const {
+  int64_t count;
+  if (!scale_table.empty()) {
+    count = data[p] ? scale_table[data[p]] : 0;
+  } else if (count_size == 1) {
+    count = data[p];
+  } else if (count_size == 2) {
+    count = data[p] | (data[p + 1] << 8);
+  } else {
+    count = get(data + p, count_size);
+  }
+
+  if (count <= 0) fail(p, "bad count");
+  return count;
+}
+
+void IndexReader::entry(off_t p, off_t start, int count_size, int offset_size,
+                        Choice* choice) const {
+  choice->count = get_count(p, count_size);
+
+  p += count_size;
+  if (offset_size == 0) {
+    choice->next = (off_t) -1;
+  } else if (offset_size == 1) {
+    off_t offset = data[p];
+    choice->next = (offset == 255) ? (off_t) -1 : start - offset;
+  } else if (offset_size == 2) {
+    off_t offset = data[p] | (data[p + 1] << 8);
+    choice->next = (offset == 65535) ? (off_t) -1 : start - offset;
+  } else {
+    off_t offset = 0;
+    for (int j = 0; j < offset_size; ++j)
+      offset |= (uint64_t)(data[p + j]) << (j * 8);
+    assert(offset_size == sizeof(off_t));
+    if (offset == (off_t) -1)
+      choice->next = (off_t) -1;
+    else
+      choice->next = start - offset;
+  }
+
+  if (choice->next != (off_t) -1 && (choice->next < 0 || choice->next > start))
+    fail(p, "bad offset");
+}
+
+uint64_t IndexReader::get_varint(off_t* p, off_t end) const {
+  uint64_t value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    if (*p >= end) fail(*p, "varint overrun");
+    unsigned char byte = data[(*p)++];
+    value |= uint64_t(byte & 0x7F) << shift;
+    if ((byte & 0x80) == 0) return value;
+  }
+  fail(*p, "varint too long");
+  return 0;
+}
+
+void IndexReader::varint_entry(off_t* p, off_t start, off_t end,
+                               off_t* base, Choice* choice) const {
+  off_t at = *p;
+  if (!scale_table.empty()) {
+    if (*p >= end) fail(at, "need count");
+    choice->count = get_count((*p)++, 1);
+  } else {
+    choice->count = get_varint(p, end);
+    if (choice->count <= 0) fail(at, "bad count");
+  }
+
+  uint64_t offset = get_varint(p, end);
+  if (offset == 0) {
+    choice->next = (off_t) -1;
+    return;
+  }
+
+  uint64_t zigzag = offset - 1;
+  off_t distance = (zigzag >> 1) ^ -off_t(zigzag & 1);
+  choice->next = *base - distance;
+  if (choice->next < 0 || choice->next > start) fail(at, "bad offset");
+  *base = choice->next;
+}
+
+void IndexReader::cursor(off_t n, int64_t count,
+                         char min, char max,
+                         Cursor* out) const {
+  out->reader = this;
+  out->count = count;
+  out->min = min;
+  out->max = max;
+  out->num = 0;
+  out->summarized = false;
+  if (n == (off_t) -1) {
+    out->kind = Cursor::EMPTY;
+    return;
+  }
+
+  if (!cache_slots.empty()) {
+    int slot = cache_slots[cache_slot(n)];
+    if (slot >= 0) {
+      Cached const& node = cached[slot];
+      out->kind = Cursor::CACHED;
+      out->entries = cache_choices + node.first;
+      out->entries_sum = node.sum;
+      out->num = node.num;
+      out->summarized = node.summarized;
+      out->summary = node.summary;
+      out->p = lower_bound(out->entries, out->entries + node.num, min,
+                           letter_before) - out->entries;
+      return;
+    }
+  }
 
-  Choice choice;
   assert(n >= 1 && n <= length);
+  if (n >= 3 && data[n - 1] == 0 && data[n - 2] == 0 && data[n - 3] == 0x02) {
+    if (n < 14) fail(n - 3, "need summary");
+    n -= 13;
+    out->summarized = true;
+    out->summary.letters = get(data + n, 8);
+    out->summary.min = data[n + 8];
+    out->summary.max = data[n + 9];
+  }
+
   int num = data[--n];
   assert(num >= 0 && num < 0x100);
 
   if (num >= 0x20 && num < 0x80) {
     if (n < 1) fail(n, "need immediate next");
-    if (num >= min && num <= max) {
-      choice.ch = num;
-      choice.count = count;
-      choice.next = n;
-      out->push_back(choice);
+    out->kind = Cursor::LETTER;
+    out->choice.ch = num;
+    out->choice.count = count;
+    out->choice.next = n;
+    out->count = 0;
+    return;
+  }
+
+  int type = 0;
+  if (num == 0 && n >= 2 && data[n - 1] == 0) {
+    n -= 2;
+    num = type = data[n];
+    if (type == 0x23) {
+      // the size is a varint with its bytes reversed, read backwards
+      uint64_t size = 0;
+      for (int shift = 0; ; shift += 7) {
+        if (n < 1 || shift >= 64) fail(n, "bad size");
+        size |= uint64_t(data[--n] & 0x7F) << shift;
+        if ((data[n] & 0x80) == 0) break;
+      }
+
+      if (size == 0 || size > uint64_t(n)) fail(n, "bad size");
+      out->kind = Cursor::VARINT;
+      out->size = size;
+      out->start = out->p = out->base = n - size;
+      return;
     }
-    return 0;
+    if ((type & 0x1F) != 0x01) fail(n, "unknown node type");
   }
 
-  int count_size = (num < 0xC0) ? 1 : (num < 0xE0) ? 2 : 8;
-  int offset_size = (num < 0x20) ? 0 : (num < 0xA0) ? 1 : (num < 0xE0) ? 2 : 8;
+  out->count_size =
+      !scale_table.empty() ? 1 : (num < 0xC0) ? 1 : (num < 0xE0) ? 2 : 8;
+  out->offset_size =
+      (num < 0x20) ? 0 : (num < 0xA0) ? 1 : (num < 0xE0) ? 2 : 8;
+
+  if (type != 0) {
+    if (n < 8) fail(n, "need mask");
+    n -= 8;
+    uint64_t mask = get(data + n, 8);
+
+    out->kind = Cursor::BITMAP;
+    out->size = out->count_size + out->offset_size;
+    out->num = __builtin_popcountll(mask);
+    if (out->num == 0 || n < out->num * out->size) fail(n, "bad size");
+
+    out->start = n - out->num * out->size;
+    int lo = bits_below(min), hi = bits_below(max + 1);
+    uint64_t below = (lo < 64) ? (uint64_t(1) << lo) - 1 : ~uint64_t(0);
+    uint64_t range = (hi < 64) ? (uint64_t(1) << hi) - 1 : ~uint64_t(0);
+    out->range = mask & range & ~below;
+    out->p = out->start + __builtin_popcountll(mask & below) * out->size;
+    return;
+  }
 
   num = num & 0x1F;
   if (num == 0) {
@@ -66,52 +497,96 @@ int IndexReader::children(off_t n, int64_t count,
     num = data[--n];
   }
 
-  ssize_t size = count_size + offset_size + 1;
-  if (num == 0 || n < num * size) fail(n, "bad size");
+  out->kind = Cursor::TABLE;
+  out->size = out->count_size + out->offset_size + 1;
+  out->num = num;
+  if (num == 0 || n < num * out->size) fail(n, "bad size");
 
-  off_t start = n - num * size;
-  for (off_t p = start; p < n; p += size) {
-    choice.ch = data[p];
-    if (choice.ch < min || choice.ch > max) continue;  // TODO: binary search
+  out->start = out->p = n - num * out->size;
+}
 
-    if (count_size == 1) {
-      choice.count = data[p + 1];
-    } else if (count_size == 2) {
-      choice.count = data[p + 1] | (data[p + 2] << 8);
-    } else {
-      choice.count = 0;
-      for (int j = 0; j < count_size; ++j)
-        choice.count |= data[p + 1 + j] << (j * 8);
-    }
+bool IndexReader::Cursor::next() {
+  switch (kind) {
+    case LETTER:
+      kind = EMPTY;
+      return (choice.ch >= min && choice.ch <= max);
 
-    if (choice.count <= 0) fail(p + 1, "bad count");
-    
-    if (offset_size == 0) {
-      choice.next = (off_t) -1;
-    } else if (offset_size == 1) {
-      off_t offset = data[p + 1 + count_size];
-      choice.next = (offset == 255) ? (off_t) -1 : start - offset;
-    } else if (offset_size == 2) {
-      off_t offset = data[p + count_size + 1] | (data[p + count_size + 2] << 8);
-      choice.next = (offset == 65535) ? (off_t) -1 : start - offset;
-    } else {
-      off_t offset = 0;
-      for (int j = 0; j < offset_size; ++j)
-        offset |= (uint64_t)(data[p + 1 + count_size + j]) << (j * 8);
-      assert(offset_size == sizeof(off_t));
-      if (offset == (off_t) -1)
-        choice.next = (off_t) -1;
-      else
-        choice.next = start - offset;
-    }
+    case BITMAP:
+      if (range == 0) return false;
+      choice.ch = bit_letter(__builtin_ctzll(range));
+      range &= range - 1;
+      reader->entry(p, start, count_size, offset_size, &choice);
+      p += size;
+      count -= choice.count;
+      return true;
+
+    case TABLE:
+      // letters are in order, so stop at the first one past the range
+      for (; p < start + num * size; p += size) {
+        choice.ch = reader->data[p];
+        if (choice.ch > max) break;
+        if (choice.ch < min) continue;
+        reader->entry(p + 1, start, count_size, offset_size, &choice);
+        p += size;
+        count -= choice.count;
+        return true;
+      }
+      p = start + num * size;
+      return false;
+
+    case VARINT:
+      // letters are in order here too, but entries vary in length
+      while (p < start + size) {
+        choice.ch = reader->data[p++];
+        if (choice.ch > max) break;
+        reader->varint_entry(&p, start, start + size, &base, &choice);
+        if (choice.ch < min) continue;
+        count -= choice.count;
+        return true;
+      }
+      p = start + size;
+      return false;
 
-    if (choice.next != (off_t) -1 && (choice.next < 0 || choice.next > start))
-      fail(p + 1 + count_size, "bad offset");
-    out->push_back(choice);
-    count -= choice.count;
+    case CACHED:
+      if (p == num || entries[p].ch > max) return false;
+      choice = entries[p++];
+      count -= choice.count;
+      return true;
+
+    default:
+      return false;
   }
+}
 
-  return count;
+int64_t IndexReader::Cursor::sum() const {
+  if (kind == EMPTY) return 0;
+  if (kind == LETTER) return choice.count;
+  if (kind == CACHED) return entries_sum;
+  int64_t total = 0;
+  if (kind == VARINT) {
+    off_t q = start, b = start;
+    Choice c;
+    while (q < start + size) {
+      ++q;
+      reader->varint_entry(&q, start, start + size, &b, &c);
+      total += c.count;
+    }
+    return total;
+  }
+
+  off_t first = start + (kind == TABLE ? 1 : 0);
+  for (off_t q = first; q < first + num * size; q += size)
+    total += reader->get_count(q, count_size);
+  return total;
+}
+
+int IndexReader::children(off_t n, int64_t count,
+                          char min, char max,
+                          std::vector<Choice>* out) const {
+  Cursor c;
+  cursor(n, count, min, max, &c);
+  while (c.next()) out->push_back(c.choice);
+  return c.count;
 }
 
 void IndexReader::fail(off_t n, const char* message) const {
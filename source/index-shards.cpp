@@ -0,0 +1,78 @@
+#include "index.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+using namespace std;
+
+IndexShards::IndexShards(const char* name,
+                         IndexReader::Options const& options) {
+  FILE* fp = fopen(name, "rb");
+  if (fp != NULL) {
+    files.push_back(fp);
+  } else {
+    while ((fp = fopen(shard_name(name, files.size()).c_str(), "rb")) != NULL)
+      files.push_back(fp);
+  }
+
+  if (files.empty()) {
+    fprintf(stderr, "error: can't open \"%s\"\n", name);
+    exit(1);
+  }
+
+  for (size_t i = 0; i < files.size(); ++i)
+    shards.push_back(new IndexReader(files[i], options));
+
+  while ((fp = fopen(delta_name(name, added.size()).c_str(), "rb")) != NULL) {
+    files.push_back(fp);
+    added.push_back(new IndexReader(fp, options));
+  }
+
+  merged = NULL;
+  if (!added.empty()) {
+    std::vector<const IndexReader*> all(shards);
+    all.insert(all.end(), added.begin(), added.end());
+    merged = new IndexOverlay(all);
+  }
+}
+
+IndexShards::~IndexShards() {
+  delete merged;
+  for (size_t i = 0; i < shards.size(); ++i) delete shards[i];
+  for (size_t i = 0; i < added.size(); ++i) delete added[i];
+  for (size_t i = 0; i < files.size(); ++i) fclose(files[i]);
+}
+
+// name.index becomes name plus the suffix
+static string Stem(const char* name, const char* suffix, int n) {
+  string base(name);
+  size_t len = strlen(".index");
+  if (base.size() > len && base.compare(base.size() - len, len, ".index") == 0)
+    base.resize(base.size() - len);
+
+  char buf[32];
+  snprintf(buf, sizeof(buf), suffix, n);
+  return base + buf;
+}
+
+string IndexShards::shard_name(const char* name, int shard) {
+  return Stem(name, ".%d.index", shard);
+}
+
+string IndexShards::delta_name(const char* name, int delta) {
+  return Stem(name, ".delta.%d.index", delta);
+}
+
+void IndexShards::partition(int64_t const first[256], int shards,
+                            int shard_of[256]) {
+  int64_t total = 0;
+  for (int ch = 0; ch < 256; ++ch) total += first[ch];
+
+  int64_t sofar = 0;
+  for (int ch = 0, shard = 0; ch < 256; ++ch) {
+    if (sofar >= (shard + 1) * (total / shards) && shard + 1 < shards)
+      ++shard;
+    shard_of[ch] = shard;
+    sofar += first[ch];
+  }
+}
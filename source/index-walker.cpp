@@ -3,22 +3,22 @@
 #include <assert.h>
 #include <limits.h>
 #include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
 
 using namespace std;
 
-IndexWalker::IndexWalker(const IndexReader* r, off_t node, int64_t count):
+IndexWalker::IndexWalker(const IndexReader* r, off_t node, int64_t count,
+                         char min, char max):
     reader(r), buf(NULL), buf_alloc(0) {
   stack.resize((stack_size = 1));
-  stack[0].next = 0;
-  reader->children(node, count, CHAR_MIN, CHAR_MAX, &stack[0].choices);
+  reader->cursor(node, count, min, max, &stack[0]);
   next();
 }
 
 void IndexWalker::next() {
-  while (stack_size > 0 &&
-         stack[stack_size - 1].next == stack[stack_size - 1].choices.size()) {
-    stack[--stack_size].choices.clear();
-  }
+  while (stack_size > 0 && !stack[stack_size - 1].next()) --stack_size;
 
   if (stack_size == 0) {
     text = NULL;
@@ -31,21 +31,91 @@ void IndexWalker::next() {
 
   do {
     if (++stack_size > stack.size()) stack.resize(stack_size);
-    State *parent = &stack[stack_size - 2], *child = &stack[stack_size - 1];
-    IndexReader::Choice const& choice = parent->choices[parent->next++];
+    IndexReader::Cursor *parent = &stack[stack_size - 2];
+    IndexReader::Cursor *child = &stack[stack_size - 1];
+    IndexReader::Choice const& choice = parent->choice;
 
-    child->next = 0;
-    assert(child->choices.empty());
-    count = reader->children(
-        choice.next, choice.count, CHAR_MIN, CHAR_MAX, &child->choices);
+    reader->cursor(choice.next, choice.count, CHAR_MIN, CHAR_MAX, child);
+    count = choice.count - child->sum();
 
     if (stack_size - 1 >= buf_alloc)
       buf = (char*) realloc(buf, (buf_alloc = stack_size*2));
     buf[stack_size - 2] = choice.ch;
-  } while (count == 0);
+  } while (count == 0 && stack[stack_size - 1].next());
 
   assert(count > 0);
   assert(stack_size - 1 < buf_alloc);
   buf[stack_size - 1] = '\0';
   text = buf;
 }
+
+WalkerMerge::WalkerMerge(std::vector<IndexWalker*> const& w):
+    walkers(w), losers(max<size_t>(w.size(), 1), 0), shared(w.size(), 0) {
+  // Leaf i is node n + i; play the first matches from the bottom up
+  const size_t n = walkers.size();
+  std::vector<int> winners(2 * n);
+  for (size_t i = 0; i < n; ++i) winners[n + i] = i;
+  for (size_t node = n; node-- > 1;) {
+    int a = winners[2 * node], b = winners[2 * node + 1];
+    winners[node] = play(a, b);
+    losers[node] = (winners[node] == a) ? b : a;
+  }
+
+  if (n > 0) losers[0] = winners[1];
+  show();
+}
+
+WalkerMerge::~WalkerMerge() {
+  for (size_t i = 0; i < walkers.size(); ++i) delete walkers[i];
+}
+
+void WalkerMerge::next() {
+  if (text == NULL) return;
+
+  // Only the last winner has changed, so replay its path to the top
+  int winner = losers[0];
+  walkers[winner]->next();
+  shared[winner] = walkers[winner]->same;
+  for (size_t node = (walkers.size() + winner) / 2; node >= 1; node /= 2) {
+    int loser = losers[node];
+    if (play(winner, loser) == loser) {
+      losers[node] = winner;
+      winner = loser;
+    }
+  }
+
+  losers[0] = winner;
+  show();
+}
+
+// Both walkers' shared[] are against the same text, the last to win at this
+// node, which comes before both.  The loser's becomes its prefix shared
+// with the winner.
+int WalkerMerge::play(int a, int b) {
+  const char* x = walkers[a]->text;
+  const char* y = walkers[b]->text;
+  if (y == NULL) return a;
+  if (x == NULL) return b;
+
+  // Whichever has more in common with the earlier text comes first, and
+  // the other shares just as much with it
+  if (shared[a] != shared[b]) return (shared[a] > shared[b]) ? a : b;
+
+  int64_t same = shared[a];
+  assert(memcmp(x, y, same) == 0);
+  while (x[same] != '\0' && x[same] == y[same]) ++same;
+  if ((unsigned char) x[same] <= (unsigned char) y[same]) {
+    shared[b] = same;
+    return a;
+  } else {
+    shared[a] = same;
+    return b;
+  }
+}
+
+void WalkerMerge::show() {
+  IndexWalker const* winner = walkers.empty() ? NULL : walkers[losers[0]];
+  text = winner ? winner->text : NULL;
+  same = text ? shared[losers[0]] : 0;
+  count = text ? winner->count : 0;
+}
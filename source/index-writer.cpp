@@ -1,16 +1,116 @@
 #include "index.h"
 
 #include <assert.h>
+#include <math.h>
+#include <stdlib.h>
 #include <sys/mman.h>
 
 #include <algorithm>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 
 using namespace std;
 
-IndexWriter::IndexWriter(FILE *f): fp(f), pos(ftello(fp)) {
+static void put_varint(uint64_t value, std::vector<unsigned char>* out) {
+  for (; value >= 0x80; value >>= 7) out->push_back((value & 0x7F) | 0x80);
+  out->push_back(value);
+}
+
+// Writes full blocks to the file on a thread of its own, so the next block
+// can be filled meanwhile.
+struct IndexWriter::Flusher {
+  FILE* const fp;
+  thread runner;
+  mutex lock;
+  condition_variable changed;
+  std::vector<unsigned char> pending;
+  bool busy, stop;
+
+  Flusher(FILE* f): fp(f), busy(false), stop(false) {
+    pending.reserve(BLOCK_SIZE);
+    runner = thread(&Flusher::run, this);
+  }
+
+  ~Flusher() {
+    {
+      lock_guard<mutex> hold(lock);
+      stop = true;
+    }
+    changed.notify_all();
+    runner.join();
+  }
+
+  void run() {
+    unique_lock<mutex> hold(lock);
+    for (;;) {
+      while (!busy && !stop) changed.wait(hold);
+      if (!busy) return;
+      hold.unlock();
+      fwrite(&pending[0], 1, pending.size(), fp);
+      hold.lock();
+      pending.clear();
+      busy = false;
+      changed.notify_all();
+    }
+  }
+
+  // Swaps in a block to write, once the last one is written.
+  void write(std::vector<unsigned char>* block) {
+    unique_lock<mutex> hold(lock);
+    while (busy) changed.wait(hold);
+    pending.swap(*block);
+    busy = true;
+    changed.notify_all();
+  }
+
+  void wait() {
+    unique_lock<mutex> hold(lock);
+    while (busy) changed.wait(hold);
+  }
+};
+
+IndexWriter::IndexWriter(FILE *f):
+    fp(f), pos(ftello(fp)), summary_span(0), compact(false), flusher(NULL),
+    shared_limit(0) {
+  block.reserve(BLOCK_SIZE);
   chain.resize((chain_size = 1));
   chain[0].ch = '\0';
   chain[0].count = 0;
+  for (int i = 0; i < 16; ++i) nodes[i] = 0;
+}
+
+IndexWriter::~IndexWriter() {
+  flush();
+  delete flusher;
+}
+
+void IndexWriter::set_background(bool on) {
+  flush();
+  delete flusher;
+  flusher = on ? new Flusher(fp) : NULL;
+}
+
+void IndexWriter::put(unsigned char const* bytes, size_t size) {
+  block.insert(block.end(), bytes, bytes + size);
+  if (block.size() >= BLOCK_SIZE) write_block();
+}
+
+void IndexWriter::write_block() {
+  if (block.empty()) return;
+  if (flusher != NULL) {
+    flusher->write(&block);
+    block.reserve(BLOCK_SIZE);
+  } else {
+    fwrite(&block[0], 1, block.size(), fp);
+    block.clear();
+  }
+}
+
+void IndexWriter::flush() {
+  write_block();
+  if (flusher != NULL) flusher->wait();
 }
 
 void IndexWriter::next(const char *text, int same, int64_t count) {
@@ -19,14 +119,7 @@ void IndexWriter::next(const char *text, int same, int64_t count) {
   while (text != NULL && same + 1 < int(chain_size) &&
          text[same] == chain[same + 1].ch) ++same;
 
-  while (int(chain_size) - 1 > same) {
-    assert(chain_size >= 2);
-    Pending *pending = &chain[--chain_size];
-    Pending *parent = &chain[chain_size - 1];
-    parent->choices.push_back(write(fp, *pending));
-    pending->choices.clear();
-  }
-
+  write_chain(same);
   assert(chain_size >= 1);
   while (text != NULL && text[chain_size - 1] != '\0') {
     if (++chain_size > chain.size()) chain.resize(chain_size);
@@ -39,13 +132,222 @@ void IndexWriter::next(const char *text, int same, int64_t count) {
 
   if (text == NULL) {
     assert(same == 0 && count == 0 && chain_size == 1);
-    write(fp, chain[0]);
+    Saved root = { 0, 0, -1, -1, { 0, 0, 0 } };
+    if (!chain[0].choices.empty()) root = write(chain[0]);
+    write_trailer(root.pos, root.count);
+    flush();
     chain.clear();
     assert(ftello(fp) == pos);
   }
 }
 
-IndexWriter::Saved IndexWriter::write(FILE* fp, Pending const& in) {
+void IndexWriter::write_chain(int same) {
+  while (int(chain_size) - 1 > same) {
+    assert(chain_size >= 2);
+    Pending *pending = &chain[--chain_size];
+    Pending *parent = &chain[chain_size - 1];
+    parent->choices.push_back(write(*pending));
+    pending->choices.clear();
+  }
+}
+
+void IndexWriter::end_part() {
+  write_chain(0);
+  flush();
+}
+
+void IndexWriter::add_part(IndexWriter* part) {
+  assert(chain_size == 1 && part->chain_size == 1);
+  if (fflush(part->fp) != 0 || fseeko(part->fp, 0, SEEK_SET) != 0) {
+    fprintf(stderr, "error: can't read index part\n");
+    exit(1);
+  }
+
+  // Copy the part's nodes, then take its top entries, moved to match (all
+  // other offsets are relative, so the nodes need no change).
+  off_t base = pos;
+  std::vector<unsigned char> buf(BLOCK_SIZE);
+  size_t size;
+  while ((size = fread(&buf[0], 1, buf.size(), part->fp)) > 0) {
+    put(&buf[0], size);
+    pos += size;
+  }
+  if (pos - base != part->pos) {
+    fprintf(stderr, "error: can't read index part\n");
+    exit(1);
+  }
+
+  for (size_t i = 0; i < part->chain[0].choices.size(); ++i) {
+    Saved choice = part->chain[0].choices[i];
+    if (choice.pos != -1) {
+      choice.pos += base;
+      choice.start += base;
+    }
+    assert(chain[0].choices.empty() || chain[0].choices.back().ch < choice.ch);
+    chain[0].choices.push_back(choice);
+  }
+
+  chain[0].count += part->chain[0].count;
+  for (int i = 0; i < 16; ++i) nodes[i] += part->nodes[i];
+}
+
+void IndexWriter::write_trailer(off_t root, int64_t total) {
+  // exact indexes keep the version 1 trailer, readable by older readers
+  int version = scale.empty() ? 1 : 2;
+  int size = IndexReader::TRAILER_SIZE + scale.size() * 8;
+  std::vector<unsigned char> trailer(size);
+  unsigned char* p = &trailer[0];
+  for (int j = 0; j < 8; ++j) *p++ = root >> (j * 8);
+  for (int j = 0; j < 8; ++j) *p++ = total >> (j * 8);
+  for (int i = 0; i < 16; ++i)
+    for (int j = 0; j < 8; ++j) *p++ = nodes[i] >> (j * 8);
+  for (size_t i = 0; i < scale.size(); ++i)
+    for (int j = 0; j < 8; ++j) *p++ = scale[i] >> (j * 8);
+  for (int j = 0; j < 4; ++j) *p++ = version >> (j * 8);
+  for (int j = 0; j < 4; ++j) *p++ = size >> (j * 8);
+
+  uint64_t sum = IndexReader::checksum(&trailer[0], p - &trailer[0]);
+  for (int j = 0; j < 8; ++j) *p++ = sum >> (j * 8);
+  for (int j = 0; j < 8; ++j) *p++ = IndexReader::TRAILER_MAGIC[j];
+  assert(p == &trailer[0] + size);
+
+  put(&trailer[0], size);
+  pos += size;
+}
+
+std::vector<int64_t> IndexWriter::log_scale(int64_t most) {
+  // Each value is a constant factor above the last, recomputed as we go so
+  // the last value is the limit, but at least one more than the last, so
+  // small frequencies stay exact.
+  std::vector<int64_t> table(256, 0);
+  table[1] = 1;
+  for (int i = 2; i < 256; ++i) {
+    double factor = pow(double(most) / table[i - 1], 1.0 / (256 - i));
+    table[i] = max<int64_t>(table[i - 1] + 1, llround(table[i - 1] * factor));
+  }
+  return table;
+}
+
+int64_t IndexWriter::code(int64_t count) const {
+  // the nearest value on a log scale
+  size_t i = lower_bound(scale.begin() + 1, scale.end(), count) - scale.begin();
+  if (i == scale.size()) return i - 1;
+  if (i > 1 && double(count) * count < double(scale[i - 1]) * scale[i])
+    return i - 1;
+  return i;
+}
+
+IndexWriter::Saved IndexWriter::write(Pending const& in) {
+  static const off_t none = -1;
+  static const int most = 0xFF;
+
+  // A node with the same counts and children as one already written (so
+  // the same subtree) can point to that one instead.  Only nearby nodes are
+  // reused, since a longer offset would widen every entry of the parent
+  // (most shared nodes are small, like a last letter and a count); a node
+  // further back is written again and becomes the one to reuse.
+  std::string key;
+  if (shared_limit > 0 && !in.choices.empty()) {
+    key.append((char const*) &in.count, sizeof(in.count));
+    for (size_t i = 0; i < in.choices.size(); ++i) {
+      Saved const& choice = in.choices[i];
+      key.push_back(choice.ch);
+      key.append((char const*) &choice.count, sizeof(choice.count));
+      key.append((char const*) &choice.pos, sizeof(choice.pos));
+    }
+
+    unordered_map<std::string, Saved>::const_iterator it = shared.find(key);
+    if (it != shared.end() && pos - it->second.pos < 0xFFFF) {
+      // Nothing is written here, so the parent's span shouldn't reach back
+      // to where the copy was.
+      Saved out = it->second;
+      out.ch = in.ch;
+      out.start = pos;
+      return out;
+    }
+  }
+
+  off_t start = pos;
+  Saved out = write_node(in);
+
+  // A leaf reaches no space and ends at once; a space child is a space at
+  // distance 0; any other child adds one letter to its own paths.
+  out.summary.min = most;
+  out.summary.max = 0;
+  out.summary.letters = 0;
+  for (size_t i = 0; i < in.choices.size(); ++i) {
+    Saved const& choice = in.choices[i];
+    if (choice.pos != none) start = min(start, choice.start);
+    if (choice.ch == ' ') {
+      out.summary.min = 0;
+      continue;
+    }
+
+    int bit = IndexReader::letter_bit(choice.ch);
+    out.summary.letters |= (bit < 0) ? ~uint64_t(0) : uint64_t(1) << bit;
+    if (choice.pos == none) {
+      out.summary.max = max(out.summary.max, 1);
+    } else {
+      out.summary.letters |= choice.summary.letters;
+      out.summary.min = min(out.summary.min, min(choice.summary.min + 1, most));
+      out.summary.max = max(out.summary.max, min(choice.summary.max + 1, most));
+    }
+  }
+
+  out.start = start;
+  if (out.pos != none && summary_span > 0 && out.pos - start >= summary_span) {
+    write_summary(out.summary);
+    out.pos = pos;
+  }
+
+  if (!key.empty()) {
+    if (shared.size() >= shared_limit) shared.clear();
+    shared[key] = out;
+  }
+  return out;
+}
+
+void IndexWriter::write_summary(IndexReader::Summary const& in) {
+  for (int j = 0; j < 8; ++j)
+    put(in.letters >> (j * 8));
+  put(in.min);
+  put(in.max);
+  put(0x02);
+  put(0);
+  put(0);
+  pos += 13;
+}
+
+IndexReader::Node IndexWriter::copy_node(
+    std::vector<IndexReader::Choice> const& choices, int64_t count,
+    IndexReader::Summary const* summary) {
+  assert(chain_size == 1 && chain[0].choices.empty());
+  Pending in;
+  in.ch = 0;
+  in.count = count;
+  in.choices.resize(choices.size());
+  for (size_t i = 0; i < choices.size(); ++i) {
+    in.choices[i].ch = choices[i].ch;
+    in.choices[i].count = choices[i].count;
+    in.choices[i].pos = in.choices[i].start = choices[i].next;
+  }
+
+  Saved out = write_node(in);
+  if (summary != NULL && out.pos != -1) {
+    write_summary(*summary);
+    out.pos = pos;
+  }
+  return out.pos;
+}
+
+void IndexWriter::finish(IndexReader::Node root, int64_t total) {
+  assert(chain_size == 1 && chain[0].choices.empty());
+  write_trailer(root, total);
+  flush();
+  chain.clear();
+}
+
+IndexWriter::Saved IndexWriter::write_node(Pending const& in) {
   Saved out;
   out.ch = in.ch;
   out.count = in.count;
@@ -61,7 +363,8 @@ IndexWriter::Saved IndexWriter::write(FILE* fp, Pending const& in) {
       in.choices[0].ch >= 0x20 &&
       in.choices[0].ch < 0x80 &&
       in.choices[0].pos == pos) {
-    fputc(in.choices[0].ch, fp);
+    put(in.choices[0].ch);
+    ++nodes[in.choices[0].ch >> 5];
     out.pos = ++pos;
     out.count = in.choices[0].count;
     assert(out.count > 0);
@@ -74,71 +377,110 @@ IndexWriter::Saved IndexWriter::write(FILE* fp, Pending const& in) {
     assert(i == 0 || in.choices[i].ch > in.choices[i - 1].ch);
     assert(in.choices[i].count > 0);
     out.count += in.choices[i].count;
-    max_count = max(max_count, in.choices[i].count);
+    max_count = max(max_count, scale.empty() ? in.choices[i].count
+                                             : code(in.choices[i].count));
     if (in.choices[i].pos != none)
       max_offset = max(max_offset, max<int64_t>(pos - in.choices[i].pos, 1));
   }
 
-  int mode;
+  int mode, count_size, offset_size;
   if (max_offset == 0 && max_count < 0x100) {
-    mode = 0;
-    for (size_t i = 0; i < in.choices.size(); ++i) {
-      fputc(in.choices[i].ch, fp);
-      fputc(in.choices[i].count, fp);
-    }
-    pos += 2 * in.choices.size();
+    mode = 0x00; count_size = 1; offset_size = 0;
   } else if (max_offset < 0xFF && max_count < 0x100) {
-    mode = 0x80;
-    for (size_t i = 0; i < in.choices.size(); ++i) {
-      fputc(in.choices[i].ch, fp);
-      fputc(in.choices[i].count, fp);
-      fputc(in.choices[i].pos == none ? -1 : pos - in.choices[i].pos, fp);
-    }
-    pos += 3 * in.choices.size();
+    mode = 0x80; count_size = 1; offset_size = 1;
   } else if (max_offset < 0xFFFF && max_count < 0x100) {
-    mode = 0xA0;
-    for (size_t i = 0; i < in.choices.size(); ++i) {
-      fputc(in.choices[i].ch, fp);
-      fputc(in.choices[i].count, fp);
-      off_t op = in.choices[i].pos == none ? -1 : pos - in.choices[i].pos;
-      fputc(op, fp);
-      fputc(op >> 8, fp);
-    }
-    pos += 4 * in.choices.size();
+    mode = 0xA0; count_size = 1; offset_size = 2;
   } else if (max_offset < 0xFFFF && max_count < 0x10000) {
-    mode = 0xC0;
-    for (size_t i = 0; i < in.choices.size(); ++i) {
-      fputc(in.choices[i].ch, fp);
-      fputc(in.choices[i].count, fp);
-      fputc(in.choices[i].count >> 8, fp);
-      off_t op = in.choices[i].pos == none ? -1 : pos - in.choices[i].pos;
-      fputc(op, fp);
-      fputc(op >> 8, fp);
-    }
-    pos += 5 * in.choices.size();
+    mode = 0xC0; count_size = 2; offset_size = 2;
   } else {
-    mode = 0xE0;
-    for (size_t i = 0; i < in.choices.size(); ++i) {
-      fputc(in.choices[i].ch, fp);
-      for (int j = 0; j < 8; ++j)
-        fputc(in.choices[i].count >> (j * 8), fp);
-      off_t op = in.choices[i].pos == none ? -1 : pos - in.choices[i].pos;
-      for (int j = 0; j < 8; ++j)
-        fputc(op >> (j * 8), fp);
+    mode = 0xE0; count_size = 8; offset_size = 8;
+  }
+  if (!scale.empty()) count_size = 1;
+
+  // The bitmap form drops the letters but adds an 8-byte mask and a longer
+  // trailer, so use it only where that is no bigger (10 or more entries).
+  uint64_t mask = 0;
+  size_t num = in.choices.size();
+  bool bitmap = (num + (num < 0x20 ? 1 : 2) >= 11);
+  for (size_t i = 0; bitmap && i < num; ++i) {
+    int bit = IndexReader::letter_bit(in.choices[i].ch);
+    if (bit < 0) bitmap = false; else mask |= uint64_t(1) << bit;
+  }
+
+  if (compact) {
+    off_t fixed = (count_size + offset_size + (bitmap ? 0 : 1)) * num +
+        (bitmap ? 11 : num < 0x20 ? 1 : 2);
+    std::vector<unsigned char> bytes;
+    off_t base = pos;
+    for (size_t i = 0; i < num; ++i) {
+      bytes.push_back(in.choices[i].ch);
+      if (scale.empty())
+        put_varint(in.choices[i].count, &bytes);
+      else
+        bytes.push_back(code(in.choices[i].count));
+      if (in.choices[i].pos == none) {
+        put_varint(0, &bytes);
+      } else {
+        int64_t distance = base - in.choices[i].pos;
+        put_varint(((uint64_t(distance) << 1) ^ uint64_t(distance >> 63)) + 1,
+                   &bytes);
+        base = in.choices[i].pos;
+      }
+    }
+
+    std::vector<unsigned char> size;
+    put_varint(bytes.size(), &size);
+    bytes.insert(bytes.end(), size.rbegin(), size.rend());
+
+    if (off_t(bytes.size() + 3) < fixed) {
+      put(&bytes[0], bytes.size());
+      put(0x23);
+      put(0);
+      put(0);
+      pos += bytes.size() + 3;
+      ++nodes[8 + (0x23 >> 5)];
+      out.pos = pos;
+      return out;
     }
-    pos += 17 * in.choices.size();
   }
 
-  assert(in.choices.size() <= 0x100);
-  if (in.choices.size() < 0x20) {
-    fputc(in.choices.size() + mode, fp);
-    pos += 1;
+  // Encode the whole node straight into the output block
+  size_t entry_size = count_size + offset_size + (bitmap ? 0 : 1);
+  size_t tail_size = bitmap ? 11 : num < 0x20 ? 1 : 2;
+  size_t size = entry_size * num + tail_size;
+  size_t at = block.size();
+  block.resize(at + size);
+  unsigned char* p = &block[at];
+  for (size_t i = 0; i < num; ++i) {
+    if (!bitmap) *p++ = in.choices[i].ch;
+    int64_t count = scale.empty() ? in.choices[i].count
+                                  : code(in.choices[i].count);
+    for (int j = 0; j < count_size; ++j)
+      *p++ = count >> (j * 8);
+    off_t op = in.choices[i].pos == none ? -1 : pos - in.choices[i].pos;
+    for (int j = 0; j < offset_size; ++j)
+      *p++ = op >> (j * 8);
+  }
+
+  assert(num <= 0x100);
+  ++nodes[(mode >> 5) + (bitmap ? 8 : 0)];
+  if (bitmap) {
+    for (int j = 0; j < 8; ++j)
+      *p++ = mask >> (j * 8);
+    *p++ = mode + 0x01;
+    *p++ = 0;
+    *p++ = 0;
+  } else if (num < 0x20) {
+    *p++ = num + mode;
   } else {
-    fputc(in.choices.size(), fp);
-    fputc(mode, fp);
-    pos += 2;
+    *p++ = num;
+    *p++ = mode;
   }
 
+  assert(p == &block[0] + at + size);
+  pos += size;
+  if (block.size() >= BLOCK_SIZE) write_block();
+
   out.pos = pos;
   assert(out.count > 0);
   return out;
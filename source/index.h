@@ -1,9 +1,13 @@
 #define _FILE_OFFSET_BITS 64
+#include <limits.h>
 #include <stdio.h>
 #include <unistd.h>
 #include <stdint.h>
 
 #include <queue>
+#include <string>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 /*
@@ -35,63 +39,459 @@
 
     (letter frequency:8 offset:8)* (num[01..1F]+E0 | num E0)
 
+  Extended nodes end with two zero bytes (a "num 00" node with zero
+  entries, which the formats above never produce), preceded by a type byte
+  whose low five bits give the node kind and whose top three bits give the
+  frequency and offset widths as in the mode values above (00, 80, A0, C0, E0).
+
+  Letter-presence bitmap, used when every letter is in 20-3F or 60-7F:
+
+    (frequency offset)* mask:8 (mode+01) 00 00
+
+  Bit i of mask is set if letter i+20 (for i < 20) or i+40 (for i >= 20)
+  has an entry.  Letters are not stored; entries are in letter order, so a
+  letter's entry is found by counting the mask bits below its own.
+
+  Varint table, used (if the writer is asked) where it is smaller than the
+  fixed widths above:
+
+    (letter frequency:v offset:v)* size:v 23 00 00
+
+  Values marked :v are LEB128 varints (seven bits per byte, low bits first,
+  with the top bit set on every byte but the last), except that size, the
+  length of the entries in bytes, has its bytes in reverse order so it can
+  be read backwards.  An offset of 0 means there is no child node.  Other
+  offsets are one more than the zigzag-coded (0, -1, 1, -2, ... as 0, 1, 2,
+  3, ...) distance back to the child from the previous child in the node,
+  or for the first child, from the start of the node.
+
+  Subtree summary, optionally written after a node with a large subtree:
+
+    letters:8 min max 02 00 00
+
+  min is the fewest letters on a path from the node to a space, and max the
+  most letters on a path to a space or the end of the path (both saturate
+  at FF, and min is FF if no path reaches a space).  letters has the bits
+  (as for the bitmap mask) of every letter on those paths, other than
+  space; it is all ones if any letter has no bit.  The node itself comes
+  immediately before the summary.
+
   In all cases, offset values are from the end of the child node to the
   start of the parent node.  An offset of 0 means the child immediately
   precedes the parent node.  The maximum offset (all FF) means there is
   no child node (NULL pointer equivalent).
+
+  After the root node (the last node written) comes a trailer, with all
+  values little-endian like the node fields:
+
+    root:8 total:8 nodes:8*16 scale:8*256? version:4 size:4 checksum:8 magic:8
+
+  root is the position just past the root node (all FF for an empty index)
+  and total is the sum of all frequencies.  nodes[i] counts the nodes whose
+  final byte has i as its top three bits, or for i >= 8, the extended nodes
+  (other than summaries) whose type byte has i-8 as its top three bits.
+  size is the length of the whole trailer, checksum is the FNV-1a hash of
+  the bytes before it, and magic is "NUTRIDX" followed by a zero byte.
+  Older indexes have no trailer and end with the root node; the reader
+  falls back to scanning for them.
+
+  Version 1 trailers stop there.  Version 2 adds a scale table, used by
+  indexes that keep only approximate frequencies: every frequency field in
+  the nodes is then one byte, whatever its mode, holding a nonzero code
+  for the frequency scale[code] (the table rises roughly logarithmically).
+  The total in the trailer is still exact.
 */
 
+class IndexReader {
+ public:
+  // How to load an index; parse() takes comma-separated name=value pairs
+  // with the names below (as in $NUTRIMATIC_READER), returning false for
+  // anything it doesn't understand.
+  struct Options {
+    int cache_depth;     // "cache-depth": levels to decode at load time.
+    size_t cache_bytes;  // "cache-bytes": most memory to decode them into.
+    int advice;          // "advice": normal, random or sequential access.
+    size_t populate;     // "populate": bytes at the start to map in at once.
+    bool hugepages;      // "hugepages": 1 to ask for transparent hugepages.
+    size_t lock;         // "lock": bytes at the end (by the root) to mlock.
+    int warm_depth;      // "warm": levels to read through at load time.
+
+    Options(): cache_depth(0), cache_bytes(64 << 20), advice(-1),
+               populate(0), hugepages(false), lock(0), warm_depth(0) { }
+    bool parse(const char* spec);
+
+    // What the tools that search an index use: three levels cached, then
+    // $NUTRIMATIC_READER; prints an error and returns false if that's bad.
+    bool parse_environment();
+  };
+
+  // What loading did, for reporting.  Hints the kernel refused are noted
+  // but otherwise ignored.
+  struct LoadStats {
+    bool advice_failed, hugepages_failed, lock_failed;
+    int64_t warm_nodes, warm_faults;
+    int64_t resident_before, resident_after;  // pages, around the warmup
+    double warm_seconds;
+  };
+
+  IndexReader(FILE*, Options const& = Options());
+  ~IndexReader();
+
+  LoadStats const& load_stats() const { return stats; }
+  ssize_t size() const { return length; }
+
+  typedef off_t Node;
+  Node root() const { return root_pos; }
+  int64_t count() const { return total; }
+
+  // Trailer version (0 for older indexes), and its node counts if any.
+  int version() const { return format; }
+  int64_t nodes(int kind) const { return node_counts[kind]; }
+
+  // Tells one index from another: the trailer's checksum, or for older
+  // indexes, a hash of the last few kilobytes (with the root).
+  uint64_t fingerprint() const { return print; }
+
+  // The frequency codes of an approximate index (empty if it's exact).
+  std::vector<int64_t> const& scale() const { return scale_table; }
+
+  static const int TRAILER_VERSION = 2;
+  static const int TRAILER_SIZE = 168;  // without a scale table
+  static const char TRAILER_MAGIC[8];
+  static uint64_t checksum(const unsigned char* data, size_t size);
+
+  struct Choice { char ch; int64_t count; Node next; };
+  struct Summary { int min, max; uint64_t letters; };
+  int children(Node parent, int64_t count,
+               char min, char max,
+               std::vector<Choice>* out) const;
+
+  // Decodes a node's children one at a time, in place, without copying
+  // them out to a vector like children() does.
+  class Cursor {
+   public:
+    Choice choice;  // The current child, once next() returns true.
+    int64_t count;  // Parent count less the children returned so far.
+    bool summarized;  // True if the node has a summary, as follows.
+    Summary summary;
+
+    bool next();
+    int64_t sum() const;  // Total count of all children.
+
+   private:
+    friend class IndexReader;
+    enum { EMPTY, LETTER, TABLE, BITMAP, VARINT, CACHED } kind;
+    const IndexReader* reader;
+    char min, max;
+    int count_size, offset_size;
+    off_t start, p, size, num, base;
+    uint64_t range;
+    const Choice* entries;
+    int64_t entries_sum;
+  };
+
+  void cursor(Node parent, int64_t count,
+              char min, char max,
+              Cursor* out) const;
+
+  // Bit number of a letter in a bitmap node's mask, or -1 if it has none.
+  static int letter_bit(int ch) {
+    return (ch >= 0x20 && ch < 0x40) ? ch - 0x20 :
+           (ch >= 0x60 && ch < 0x80) ? ch - 0x40 : -1;
+  }
+
+ private:
+  const unsigned char* data;
+  ssize_t length;
+  LoadStats stats;
+  Node root_pos;
+  int64_t total;
+  int format;
+  int64_t node_counts[16];
+  uint64_t print;
+  std::vector<int64_t> scale_table;
+  bool read_trailer();
+
+  // The top levels of the trie, decoded by build_cache() into one aligned
+  // array of choices, found through an open-addressed table of nodes.
+  struct Cached {
+    Node node;
+    int64_t sum;
+    size_t first, num;
+    bool summarized;
+    Summary summary;
+  };
+  std::vector<Cached> cached;
+  std::vector<int> cache_slots;
+  Choice* cache_choices;
+  void build_cache(int depth, size_t bytes);
+  void advise(Options const&);
+  void warm(int depth);
+  int64_t resident() const;
+  size_t cache_slot(Node) const;
+  int64_t get_count(off_t p, int count_size) const;
+  void entry(off_t p, off_t start, int count_size, int offset_size,
+             Choice* out) const;
+  uint64_t get_varint(off_t* p, off_t end) const;
+  void varint_entry(off_t* p, off_t start, off_t end, off_t* base,
+                    Choice* out) const;
+  void fail(off_t n, const char* message) const;
+};
+
 class IndexWriter {
  public:
   IndexWriter(FILE*);
+  ~IndexWriter();
   void next(const char* text, int same, int64_t count);
 
+  // An index can also be written in parts, each by its own writer to a file
+  // of its own (opened for reading too), the texts of each part all coming
+  // after those of the part before (as when split by first letter, for
+  // threads to write at once).  End each part with end_part() instead of
+  // next(NULL, ...), then pass them in order to add_part() of the writer
+  // for the whole index, which copies them in; finish it as usual.
+  void end_part();
+  void add_part(IndexWriter* part);
+
+  // Output is collected in blocks, written out as they fill up and when the
+  // index is finished; with this on, each block is written by a background
+  // thread while the next one fills (off by default).
+  void set_background(bool on);
+
+  // Write a summary after nodes whose subtree spans at least this many
+  // bytes (zero, the default, writes none).
+  void set_summary_span(off_t span) { summary_span = span; }
+
+  // Write varint nodes wherever they are smaller (off by default).
+  void set_compact(bool on) { compact = on; }
+
+  // Point repeated subtrees at an identical one written shortly before,
+  // instead of writing them again, so the index becomes a DAG (the readers
+  // follow it as before).  Remembers up to this many nodes at a time; zero,
+  // the default, shares none.
+  void set_shared(size_t nodes) { shared_limit = nodes; }
+
+  // Write approximate frequencies, as one-byte codes for the values in this
+  // table (see IndexReader::scale()); an empty table, the default, keeps
+  // them exact.  log_scale() makes a table for frequencies up to a limit.
+  void set_scale(std::vector<int64_t> const& table) { scale = table; }
+  static std::vector<int64_t> log_scale(int64_t most);
+
+  // Alternatively, copy nodes one at a time in any order that puts children
+  // first (for tools that rearrange an index).  Each choice's next must be
+  // the position returned for it earlier (or -1); count is the frequency
+  // of texts ending at the node, and any summary is written after it.
+  // Finish with the root node's position and the total frequency.
+  IndexReader::Node copy_node(std::vector<IndexReader::Choice> const&,
+                              int64_t count, IndexReader::Summary const*);
+  void finish(IndexReader::Node root, int64_t total);
+
  private:
   FILE* const fp;
-  off_t pos;
+  off_t pos, summary_span;
+  bool compact;
+  std::vector<int64_t> scale;
 
-  struct Saved { int ch; int64_t count; off_t pos; };
+  static const size_t BLOCK_SIZE = 1 << 20;
+  struct Flusher;
+  std::vector<unsigned char> block;
+  Flusher* flusher;
+
+  struct Saved {
+    int ch; int64_t count; off_t pos, start;
+    IndexReader::Summary summary;
+  };
   struct Pending { int ch; int64_t count; std::vector<Saved> choices; };
   std::vector<Pending> chain;
   size_t chain_size;
+  size_t shared_limit;
+  std::unordered_map<std::string, Saved> shared;
+  int64_t nodes[16];
+
+  void put(int byte) {
+    block.push_back(byte);
+    if (block.size() >= BLOCK_SIZE) write_block();
+  }
+  void put(unsigned char const* bytes, size_t size);
+  void write_block();
+  void flush();
 
-  Saved write(FILE* fp, Pending const&);
+  void write_chain(int same);
+  Saved write(Pending const&);
+  Saved write_node(Pending const&);
+  int64_t code(int64_t count) const;
+  void write_summary(IndexReader::Summary const&);
+  void write_trailer(off_t root, int64_t total);
 };
 
-class IndexReader {
+// Several indexes read as one trie, with the counts of each text summed
+// across them: typically a large base index and a few small "deltas" of
+// texts added since (see IndexShards).  A node here stands for the nodes of
+// one text in each index that has it, and its children are theirs, merged
+// by letter.  Nodes found in more than one index are numbered as they are
+// first reached (once each, so there are no more of them than there are
+// nodes in the smaller indexes), which makes an overlay unsafe to share
+// between threads.
+class IndexOverlay {
  public:
-  IndexReader(FILE*);
-  ~IndexReader();
+  typedef IndexReader::Node Node;
 
-  typedef off_t Node;
-  Node root() const { return length; }
+  IndexOverlay(std::vector<const IndexReader*> const& segments);
+
+  Node root() const { return root_node; }
   int64_t count() const { return total; }
 
-  struct Choice { char ch; int64_t count; Node next; };
-  int children(Node parent, int64_t count,
-               char min, char max,
-               std::vector<Choice>* out) const;
+  // As for IndexReader; the summary, if every index has one for the node,
+  // covers them all.
+  int64_t children(Node parent, int64_t count, char min, char max,
+                   std::vector<IndexReader::Choice>* out) const;
+  bool summary(Node, int64_t count, IndexReader::Summary* out) const;
 
  private:
-  const unsigned char* data;
-  ssize_t length;
+  struct Part { int segment; IndexReader::Node node; int64_t count; };
+
+  std::vector<const IndexReader*> segments;
+  Node root_node;
   int64_t total;
-  void fail(off_t n, const char* message) const;
+
+  // A node in one index only is that index's node and number; others are
+  // runs of parts, numbered in order, each with its children once merged
+  // (the top few are expanded over and over).
+  struct Run {
+    size_t first, size;
+    bool merged;
+    int64_t rest;
+    std::vector<IndexReader::Choice> choices;
+  };
+  mutable std::vector<Part> parts;
+  mutable std::vector<Run> runs;
+  mutable std::unordered_map<std::string, Node> numbers;
+  mutable std::vector<std::pair<IndexReader::Choice, int> > scratch;
+
+  Node single(int segment, IndexReader::Node node) const;
+  Node number(Part const* begin, Part const* end) const;
+  void expand(Node, int64_t count, Part* one,
+              Part const** begin, Part const** end) const;
+  int64_t merge(Part const* begin, Part const* end, int64_t count,
+                char min, char max,
+                std::vector<IndexReader::Choice>* out) const;
+};
+
+// An index that may be split into shards by first letter, as merge-indexes
+// -n writes them (name.0.index, name.1.index, ... for name.index).  Opens
+// the named index if it exists, or else all of its shards, and then any
+// deltas (name.delta.0.index, ...), to be read along with it through an
+// IndexOverlay.
+class IndexShards {
+ public:
+  IndexShards(const char* name,
+              IndexReader::Options const& = IndexReader::Options());
+  ~IndexShards();
+
+  std::vector<const IndexReader*> const& readers() const { return shards; }
+  std::vector<const IndexReader*> const& deltas() const { return added; }
+  const IndexOverlay* overlay() const { return merged; }  // NULL if no deltas
+
+  static std::string shard_name(const char* name, int shard);
+  static std::string delta_name(const char* name, int delta);
+
+  // Splits texts by first letter (as an unsigned char) into shards of about
+  // equal frequency, given the count of texts under each letter, as
+  // merge-indexes -n does: letter ch goes to shard_of[ch].
+  static void partition(int64_t const first[256], int shards,
+                        int shard_of[256]);
+
+ private:
+  std::vector<const IndexReader*> shards, added;
+  std::vector<FILE*> files;
+  IndexOverlay* merged;
 };
 
+// Visits each text of an index in order, with its count.  Only for exact
+// counts: approximate ones don't add up, so an index with a scale() can't be
+// walked.
 class IndexWalker {
  public:
   const char* text;
   int64_t same, count;
 
-  IndexWalker(const IndexReader*, IndexReader::Node node, int64_t count);
+  // Walks the texts below a node, or only those whose first letter is in a
+  // range.
+  IndexWalker(const IndexReader*, IndexReader::Node node, int64_t count,
+              char min = CHAR_MIN, char max = CHAR_MAX);
   void next();
 
  private:
   const IndexReader* const reader;
   char* buf;
 
-  struct State { std::vector<IndexReader::Choice> choices; size_t next; };
-  std::vector<State> stack;
+  std::vector<IndexReader::Cursor> stack;
   size_t stack_size, buf_alloc;
 };
+
+// Merges the texts of several walkers (which it takes over) into one sorted
+// series, with a "loser tree": each node holds the walker that lost the last
+// match there, so the next text takes one match per level.  Each walker also
+// keeps the length of the prefix it shares with the last text returned (its
+// own "same" when it was the one returned), so most matches are settled
+// without looking at the texts, and the rest skip the bytes known equal.
+class WalkerMerge {
+ public:
+  const char* text;       // NULL at the end
+  int64_t same, count;    // As for IndexWalker, but across all the walkers
+
+  WalkerMerge(std::vector<IndexWalker*> const& walkers);
+  ~WalkerMerge();
+  void next();
+
+ private:
+  std::vector<IndexWalker*> walkers;
+  std::vector<int> losers;      // losers[0] is the overall winner
+  std::vector<int64_t> shared;  // Prefix shared with the last winner
+
+  int play(int a, int b);
+  void show();
+};
+
+// Passes sorted texts on to an IndexWriter, folding each word (a text
+// ending in a space) seen less than a cutoff number of times into the text
+// before it, unless it has to be kept as the prefix of a later word.
+class FrequencyCutoffWriter {
+ public:
+  FrequencyCutoffWriter(IndexWriter* out, int min);
+
+  // Unlike IndexWriter, takes same as exactly the length of the prefix the
+  // text shares with the one before (as WalkerMerge gives it).
+  void next(const char* text, int same, int64_t count);
+  void end_part();  // In place of next(NULL, ...), see IndexWriter.
+
+ private:
+  IndexWriter* const output;
+  const int cutoff;
+  size_t output_same;
+  std::string saved;
+  std::vector<std::pair<size_t, int64_t> > words;
+
+  void add(const char* text, int same, int64_t count);
+};
+
+// Applies a cutoff to an index, writing what FrequencyCutoffWriter would
+// write from its texts, but without walking every text: a subtree whose
+// total count is under the cutoff can't have any word in it kept, so its
+// count goes straight to the word above it.
+class IndexPruner {
+ public:
+  IndexPruner(const IndexReader* in, IndexWriter* out, int64_t min);
+  void run();  // Writes the whole index, finishing it.
+  int64_t skipped_subtrees() const { return skipped; }
+
+ private:
+  const IndexReader* const input;
+  IndexWriter* const output;
+  const int64_t cutoff;
+  int64_t skipped;
+  std::string text, last;
+
+  bool visit(IndexReader::Node node, int64_t count, int64_t* fold);
+  bool word(IndexReader::Choice const& choice, int64_t* fold);
+};
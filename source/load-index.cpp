@@ -0,0 +1,80 @@
+// Load a Nutrimatic index file the way a server would, and report what the
+// load options did: pages brought in by the warm-up pass (page faults that
+// later queries won't take), and any kernel hints that were refused.
+// With -k, stays running so locked and warmed pages stay in place.
+
+#include "index.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static void usage(char const* argv0) {
+  fprintf(stderr, "usage: %s [-o options] [-w depth] [-k] input.index\n",
+      argv0);
+}
+
+int main(int argc, char *argv[]) {
+  IndexReader::Options options;
+  if (!options.parse_environment()) return 2;
+
+  bool keep = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "o:w:k")) != -1) {
+    switch (opt) {
+      case 'o':
+        if (!options.parse(optarg)) {
+          fprintf(stderr, "error: bad options \"%s\"\n", optarg);
+          return 2;
+        }
+        break;
+      case 'w': options.warm_depth = atoi(optarg); break;
+      case 'k': keep = true; break;
+      default:
+        usage(argv[0]);
+        return 2;
+    }
+  }
+
+  if (optind != argc - 1) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  FILE *fp = fopen(argv[optind], "r");
+  if (fp == NULL) {
+    fprintf(stderr, "error: can't open \"%s\"\n", argv[optind]);
+    return 1;
+  }
+
+  IndexReader reader(fp, options);
+  IndexReader::LoadStats const& stats = reader.load_stats();
+  long page = sysconf(_SC_PAGESIZE);
+
+  printf("File: %zd bytes, %" PRId64 " pages\n", reader.size(),
+      int64_t((reader.size() + page - 1) / page));
+  if (stats.advice_failed) printf("Advice: refused\n");
+  if (stats.hugepages_failed) printf("Hugepages: refused\n");
+  if (options.lock > 0)
+    printf("Lock: %zu bytes%s\n", options.lock,
+        stats.lock_failed ? " refused (check ulimit -l)" : "");
+
+  if (options.warm_depth > 0) {
+    printf("Warm: %d levels, %" PRId64 " nodes, %.3f seconds, %" PRId64
+        " major faults\n", options.warm_depth, stats.warm_nodes,
+        stats.warm_seconds, stats.warm_faults);
+    if (stats.resident_before >= 0 && stats.resident_after >= 0)
+      printf("Resident: %" PRId64 " -> %" PRId64 " pages (%" PRId64
+          " faults saved for later queries)\n", stats.resident_before,
+          stats.resident_after, stats.resident_after - stats.resident_before);
+  }
+
+  if (keep) {
+    printf("Holding the index loaded; interrupt to exit.\n");
+    fflush(stdout);
+    for (;;) pause();
+  }
+
+  return 0;
+}
@@ -1,10 +1,17 @@
 #include "index.h"
 
 #include <algorithm>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 
 #include <ctype.h>
+#include <stdint.h>
+#include <getopt.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -15,16 +22,103 @@ static const size_t CHAINS_PER_FILE = 1000000;
 static const size_t MAX_LINE_LENGTH = 65536;
 static const size_t HISTORY_WINDOW_SIZE = 40;
 static const size_t TITLE_MULTIPLIER = 10;
+static const size_t BATCH_BYTES = 1 << 20;
+static const size_t MAX_RUN_BYTES = size_t(3) << 30;  // See ChainArena
 
-static void do_buffer(char *text, int *len, std::vector<string>* out) {
-  out->push_back(std::string(text, *len));
+// Chains stored end to end in one buffer, each ending in '\0', rather than
+// as separate strings.  Offsets into the buffer are 32 bits, so it must stay
+// under 4GB.
+class ChainArena {
+ public:
+  size_t size() const { return starts.size(); }
+  size_t memory() const { return bytes.size() + starts.size() * 4; }
+  char const* chain(size_t i) const { return &bytes[starts[i]]; }
+
+  void add(char const* text, size_t len) {
+    starts.push_back(bytes.size());
+    bytes.insert(bytes.end(), text, text + len);
+    bytes.push_back('\0');
+  }
+
+  // Adds chains [begin, end) of another arena.
+  void append(ChainArena const& from, size_t begin, size_t end) {
+    if (begin == end) return;
+    size_t first = from.starts[begin];
+    size_t last = end < from.size() ? from.starts[end] : from.bytes.size();
+    for (size_t i = begin; i < end; ++i)
+      starts.push_back(from.starts[i] - first + bytes.size());
+    bytes.insert(bytes.end(), &from.bytes[first], &from.bytes[0] + last);
+  }
+
+  void clear() {
+    bytes.clear();
+    starts.clear();
+  }
+
+  void swap(ChainArena& other) {
+    bytes.swap(other.bytes);
+    starts.swap(other.starts);
+  }
+
+  // Sorts the chains in byte order (as strcmp), moving only their starts.
+  void sort() {
+    std::vector<uint32_t> temp(starts.size());
+    if (!starts.empty()) radix_sort(&starts[0], &temp[0], starts.size(), 0);
+  }
+
+ private:
+  std::vector<char> bytes;
+  std::vector<uint32_t> starts;
+
+  // Chains hold only '\0', ' ', digits and lowercase letters, in that order.
+  static const int RADIX = 38;
+  static int bucket(unsigned char ch) {
+    if (ch >= 'a') return ch - 'a' + 12;
+    if (ch >= '0') return ch - '0' + 2;
+    return ch == ' ' ? 1 : 0;
+  }
+
+  // MSD radix sort of chains that are the same up to depth.
+  void radix_sort(uint32_t* chains, uint32_t* temp, size_t n, size_t depth) {
+    if (n < 32) {
+      for (size_t i = 1; i < n; ++i) {
+        uint32_t c = chains[i];
+        size_t j = i;
+        for (; j > 0 && strcmp(&bytes[chains[j - 1] + depth],
+                               &bytes[c + depth]) > 0; --j)
+          chains[j] = chains[j - 1];
+        chains[j] = c;
+      }
+      return;
+    }
+
+    size_t count[RADIX] = { 0 }, next[RADIX];
+    for (size_t i = 0; i < n; ++i) ++count[bucket(bytes[chains[i] + depth])];
+    next[0] = 0;
+    for (int b = 1; b < RADIX; ++b) next[b] = next[b - 1] + count[b - 1];
+    for (size_t i = 0; i < n; ++i)
+      temp[next[bucket(bytes[chains[i] + depth])]++] = chains[i];
+    memcpy(chains, temp, n * sizeof(*chains));
+
+    // Chains that ended here are all the same, and stay first.
+    size_t start = count[0];
+    for (int b = 1; b < RADIX; ++b) {
+      if (count[b] > 1)
+        radix_sort(chains + start, temp + start, count[b], depth + 1);
+      start += count[b];
+    }
+  }
+};
+
+static void do_buffer(char *text, int *len, ChainArena* out) {
+  out->add(text, *len);
   char* space = (char*) memchr(text, ' ', *len);
   if (space == NULL) space = text + *len - 1;
   *len -= space + 1 - text;
   memmove(text, space + 1, *len);
 }
 
-static void do_line(char const* line, std::vector<string>* out) {
+static void do_line(char const* line, ChainArena* out) {
   char buf[HISTORY_WINDOW_SIZE];
   int buflen = 0;
 
@@ -41,8 +135,8 @@ static void do_line(char const* line, std::vector<string>* out) {
   while (buflen > 0) do_buffer(buf, &buflen, out);
 }
 
-static void write_index(char const* prefix, int num,
-                        std::vector<string>* chains) {
+static void write_index(char const* prefix, int num, bool compact,
+                        ChainArena* chains) {
   size_t buf_len = strlen(prefix) + 32;
   char filename[buf_len];
   snprintf(filename, buf_len, "%s.%05d.index", prefix, num);
@@ -52,15 +146,21 @@ static void write_index(char const* prefix, int num,
     exit(1);
   }
 
+  // Each distinct chain goes to the writer once, with its count
   IndexWriter writer(fp);
-  sort(chains->begin(), chains->end());
-  for (size_t i = 0; i < chains->size(); ++i) {
+  writer.set_compact(compact);
+  chains->sort();
+  char const* last = "";
+  for (size_t i = 0; i < chains->size();) {
+    char const* text = chains->chain(i);
+    size_t j = i + 1;
+    while (j < chains->size() && !strcmp(chains->chain(j), text)) ++j;
+
     int same = 0;
-    if (i > 0) {
-      int len = min((*chains)[i - 1].size(), (*chains)[i].size());
-      while (same < len && (*chains)[i - 1][same] == (*chains)[i][same]) ++same;
-    }
-    writer.next((*chains)[i].c_str(), same, 1);
+    while (last[same] != '\0' && last[same] == text[same]) ++same;
+    writer.next(text, same, j - i);
+    last = text;
+    i = j;
   }
 
   writer.next(NULL, 0, 0);
@@ -68,34 +168,329 @@ static void write_index(char const* prefix, int num,
   fclose(fp);
 }
 
+// Reads the text, returning each line to index and how many times to count
+// it (titles count extra), or 0 at the end of the input.
+class LineReader {
+ public:
+  LineReader(FILE* in): input(in), next_line_is_title(false) {}
+
+  int next(char const** line) {
+    while (fgets(buf, sizeof(buf), input)) {
+      // Handle both output from remove-markup (with BEGIN ARTICLE: and
+      // END ARTICLE: lines) and WikiExtractor.py (with <doc ...> and </doc>).
+      if (!strncmp(buf, "BEGIN ARTICLE:", 14)) {
+        *line = buf + 14;
+        return TITLE_MULTIPLIER;
+      } else if (!strncmp(buf, "<doc ", 5)) {
+        next_line_is_title = true;
+      } else if (next_line_is_title) {
+        next_line_is_title = false;
+        *line = buf;
+        return TITLE_MULTIPLIER;
+      } else if (strncmp(buf, "END ARTICLE:", 12) &&
+          strncmp(buf, "</doc>", 6)) {
+        *line = buf;
+        return 1;
+      }
+    }
+    return 0;
+  }
+
+ private:
+  FILE* const input;
+  char buf[MAX_LINE_LENGTH];
+  bool next_line_is_title;
+};
+
+// Splits the chains of each line into files of CHAINS_PER_FILE or more (or,
+// given a memory limit, into compact runs of about that many bytes), sorting
+// and writing up to a given number of files at once.
+class FileSplitter {
+ public:
+  FileSplitter(char const* prefix, int threads, size_t run_bytes)
+      : prefix(prefix), threads(threads), run_bytes(run_bytes), filecount(0) {}
+
+  // Takes the chains [begin, end) of the arena, from one input line.
+  void add(ChainArena const& from, size_t begin, size_t end) {
+    chains.append(from, begin, end);
+    if (run_bytes > 0 ? chains.memory() >= run_bytes
+                      : chains.size() >= CHAINS_PER_FILE) flush();
+  }
+
+  int files() const { return filecount; }
+
+  void finish() {
+    if (chains.size() > 0) flush();
+    while (!writers.empty()) {
+      writers.front().join();
+      writers.pop_front();
+    }
+  }
+
+ private:
+  char const* const prefix;
+  const int threads;
+  const size_t run_bytes;
+  int filecount;
+  ChainArena chains;
+  std::deque<thread> writers;
+
+  static void write_file(char const* prefix, int num, bool compact,
+                         ChainArena* file) {
+    write_index(prefix, num, compact, file);
+    delete file;
+  }
+
+  void flush() {
+    if (threads <= 1) {
+      write_index(prefix, filecount++, run_bytes > 0, &chains);
+      return;
+    }
+
+    if (writers.size() >= size_t(threads)) {
+      writers.front().join();
+      writers.pop_front();
+    }
+
+    ChainArena* file = new ChainArena();
+    file->swap(chains);
+    writers.push_back(
+        thread(write_file, prefix, filecount++, run_bytes > 0, file));
+  }
+};
+
+// Lines of input to be split into chains by a worker thread.
+struct Batch {
+  int64_t seq;
+  std::string text;                       // Each line ends with '\0'.
+  std::vector<pair<size_t, int> > lines;  // Offset in text, and repeats.
+  ChainArena chains;
+  std::vector<size_t> ends;               // chains.size() after each line.
+};
+
+// Reads on the calling thread, splits lines into chains on worker threads,
+// and hands the chains to a FileSplitter in input order, so the files come
+// out the same as with one thread.
+class Pipeline {
+ public:
+  Pipeline(int threads, FileSplitter* out)
+      : threads(threads), output(out), next_in(0), next_out(0),
+        pending(0), reading(true) {}
+
+  void run(LineReader* reader) {
+    std::vector<thread> workers;
+    for (int i = 0; i < threads; ++i)
+      workers.push_back(thread(&Pipeline::work, this));
+    thread collector(&Pipeline::collect, this);
+
+    Batch* batch = NULL;
+    char const* line;
+    int repeat;
+    while ((repeat = reader->next(&line)) > 0) {
+      if (batch == NULL) batch = new Batch();
+      batch->lines.push_back(make_pair(batch->text.size(), repeat));
+      batch->text.append(line, strlen(line) + 1);
+      if (batch->text.size() >= BATCH_BYTES) {
+        submit(batch);
+        batch = NULL;
+      }
+    }
+    if (batch != NULL) submit(batch);
+
+    {
+      lock_guard<mutex> hold(lock);
+      reading = false;
+    }
+    changed.notify_all();
+    for (size_t i = 0; i < workers.size(); ++i) workers[i].join();
+    collector.join();
+  }
+
+ private:
+  const int threads;
+  FileSplitter* const output;
+
+  mutex lock;
+  condition_variable changed;
+  std::deque<Batch*> todo;
+  std::map<int64_t, Batch*> done;
+  int64_t next_in, next_out;
+  int pending;  // Batches submitted but not yet collected.
+  bool reading;
+
+  void submit(Batch* batch) {
+    unique_lock<mutex> hold(lock);
+    while (pending >= 4 * threads) changed.wait(hold);
+    batch->seq = next_in++;
+    todo.push_back(batch);
+    ++pending;
+    changed.notify_all();
+  }
+
+  void work() {
+    for (;;) {
+      Batch* batch;
+      {
+        unique_lock<mutex> hold(lock);
+        while (todo.empty() && reading) changed.wait(hold);
+        if (todo.empty()) return;
+        batch = todo.front();
+        todo.pop_front();
+      }
+
+      for (size_t i = 0; i < batch->lines.size(); ++i) {
+        char const* line = batch->text.data() + batch->lines[i].first;
+        for (int j = 0; j < batch->lines[i].second; ++j)
+          do_line(line, &batch->chains);
+        batch->ends.push_back(batch->chains.size());
+      }
+
+      {
+        lock_guard<mutex> hold(lock);
+        done[batch->seq] = batch;
+      }
+      changed.notify_all();
+    }
+  }
+
+  void collect() {
+    for (;;) {
+      Batch* batch;
+      {
+        unique_lock<mutex> hold(lock);
+        while (done.count(next_out) == 0 && (reading || next_out < next_in))
+          changed.wait(hold);
+        if (done.count(next_out) == 0) break;
+        batch = done[next_out];
+        done.erase(next_out++);
+        --pending;
+      }
+      changed.notify_all();
+
+      size_t begin = 0;
+      for (size_t i = 0; i < batch->ends.size(); ++i) {
+        output->add(batch->chains, begin, batch->ends[i]);
+        begin = batch->ends[i];
+      }
+      delete batch;
+    }
+  }
+};
+
+// Merges run files into one index, dropping words under the cutoff as
+// merge-indexes does, then removes them.
+static void merge_runs(char const* prefix, int runs, int cutoff,
+                       char const* name) {
+  FILE *out = fopen(name, "wb");
+  if (out == NULL) {
+    fprintf(stderr, "error: can't write \"%s\"\n", name);
+    exit(1);
+  }
+
+  std::vector<string> files;
+  std::vector<IndexReader*> readers;
+  std::vector<IndexWalker*> walkers;
+  for (int i = 0; i < runs; ++i) {
+    char filename[strlen(prefix) + 32];
+    snprintf(filename, sizeof(filename), "%s.%05d.index", prefix, i);
+    files.push_back(filename);
+    FILE *fp = fopen(filename, "r");
+    if (fp == NULL) {
+      fprintf(stderr, "error: can't read \"%s\"\n", filename);
+      exit(1);
+    }
+
+    IndexReader* reader = new IndexReader(fp);
+    fclose(fp);
+    readers.push_back(reader);
+    walkers.push_back(new IndexWalker(reader, reader->root(),
+                                      reader->count()));
+  }
+
+  IndexWriter output(out);
+  output.set_background(true);
+  FrequencyCutoffWriter writer(&output, cutoff);
+  for (WalkerMerge merge(walkers); merge.text != NULL; merge.next())
+    writer.next(merge.text, merge.same, merge.count);
+
+  writer.next(NULL, 0, 0);
+  if (fclose(out) != 0) {
+    fprintf(stderr, "error: can't write \"%s\"\n", name);
+    exit(1);
+  }
+
+  for (size_t i = 0; i < readers.size(); ++i) {
+    delete readers[i];
+    remove(files[i].c_str());
+  }
+}
+
+static void usage(char const* argv0) {
+  fprintf(stderr, "usage: %s [--threads N] [--merge min [--memory MB]] "
+      "outfileprefix < textfile.txt\n", argv0);
+}
+
 int main(int argc, char* argv[]) {
-  if (argc != 2 || argv[1][0] == '-') {
-    fprintf(stderr, "usage: %s outfileprefix < textfile.txt\n", argv[0]);
+  static const struct option long_options[] = {
+    {"threads", required_argument, NULL, 't'},
+    {"merge", required_argument, NULL, 'm'},
+    {"memory", required_argument, NULL, 'M'},
+    {NULL, 0, NULL, 0},
+  };
+
+  int threads = 1, cutoff = 0;
+  int64_t memory = 1024;
+  bool merge = false, memory_set = false;
+  int opt;
+  while ((opt = getopt_long(argc, argv, "t:m:M:", long_options, NULL)) != -1) {
+    switch (opt) {
+      case 't': threads = atoi(optarg); break;
+      case 'm': merge = true; cutoff = atoi(optarg); break;
+      case 'M': memory_set = true; memory = atoll(optarg); break;
+      default:
+        usage(argv[0]);
+        return 2;
+    }
+  }
+
+  if (optind != argc - 1 || threads < 1 || memory < 1 ||
+      (merge && cutoff < 1) || (memory_set && !merge)) {
+    usage(argv[0]);
     return 2;
   }
 
-  int filecount = 0;
-  char buf[MAX_LINE_LENGTH];
-  std::vector<string> chains;
-  bool next_line_is_title = false;
-  while (fgets(buf, sizeof(buf), stdin)) {
-    // Handle both output from remove-markup (with BEGIN ARTICLE: and
-    // END ARTICLE: lines) and WikiExtractor.py (with <doc ...> and </doc>).
-    if (!strncmp(buf, "BEGIN ARTICLE:", 14)) {
-      for (size_t i = 0; i < TITLE_MULTIPLIER; ++i) do_line(buf + 14, &chains);
-    } else if (!strncmp(buf, "<doc ", 5)) {
-      next_line_is_title = true;
-    } else if (next_line_is_title) {
-      for (size_t i = 0; i < TITLE_MULTIPLIER; ++i) do_line(buf, &chains);
-      next_line_is_title = false;
-    } else if (strncmp(buf, "END ARTICLE:", 12) && strncmp(buf, "</doc>", 6)) {
-      do_line(buf, &chains);
+  // With --merge, write sorted runs within the memory limit (shared by the
+  // run being filled and those being written), then merge them into one
+  // prefix.index, instead of writing prefix.NNNNN.index files to merge later.
+  string prefix = argv[optind], name = prefix + ".index";
+  size_t run_bytes = 0;
+  if (merge) {
+    if (fopen(name.c_str(), "rb") != NULL) {
+      fprintf(stderr, "error: output \"%s\" already exists\n", name.c_str());
+      return 1;
     }
+    prefix += ".run";
+    run_bytes = min((size_t(memory) << 20) / (threads > 1 ? threads + 1 : 1),
+                    MAX_RUN_BYTES);
+  }
 
-    if (chains.size() >= CHAINS_PER_FILE)
-      write_index(argv[1], filecount++, &chains);
+  LineReader reader(stdin);
+  FileSplitter output(prefix.c_str(), threads, run_bytes);
+  if (threads <= 1) {
+    ChainArena chains;
+    char const* line;
+    int repeat;
+    while ((repeat = reader.next(&line)) > 0) {
+      for (int i = 0; i < repeat; ++i) do_line(line, &chains);
+      output.add(chains, 0, chains.size());
+      chains.clear();
+    }
+  } else {
+    Pipeline(threads, &output).run(&reader);
   }
 
-  if (chains.size() > 0) write_index(argv[1], filecount++, &chains);
+  output.finish();
+  if (merge) merge_runs(prefix.c_str(), output.files(), cutoff,
+                             name.c_str());
   return 0;
 }
@@ -1,141 +1,351 @@
 #include "index.h"
 
 #include <algorithm>
-#include <queue>
+#include <atomic>
+#include <chrono>
+#include <mutex>
 #include <string>
+#include <thread>
 #include <vector>
 #include <utility>
 
 #include <assert.h>
+#include <limits.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 using namespace std;
 
-#define DEBUG 0
+// Output options, for every writer
+static off_t summary_span = 0;
+static bool compact = false, shared = false;
+static std::vector<int64_t> scale;
 
-struct ReaderCompare {
-  // True if x should come *after* y.
-  bool operator()(IndexWalker* x, IndexWalker* y) const {
-    int same = min(x->same, y->same);
-    assert(memcmp(x->text, y->text, same) == 0);
-    return strcmp(x->text + same, y->text + same) > 0;
+static void Configure(IndexWriter* output) {
+  output->set_summary_span(summary_span);
+  output->set_compact(compact);
+  output->set_shared(shared ? 1 << 20 : 0);
+  output->set_scale(scale);
+}
+
+// Merges the texts of every input whose first letter is in [min, max].
+static void MergeRange(std::vector<IndexReader*> const& inputs,
+                       int min, int max, FrequencyCutoffWriter* writer) {
+  std::vector<IndexWalker*> walkers;
+  for (size_t i = 0; i < inputs.size(); ++i) {
+    walkers.push_back(new IndexWalker(
+        inputs[i], inputs[i]->root(), inputs[i]->count(), min, max));
+  }
+
+  for (WalkerMerge merge(walkers); merge.text != NULL; merge.next())
+    writer->next(merge.text, merge.same, merge.count);
+}
+
+static FILE* OpenPart(const char* name) {
+  FILE* fp = fopen(name, "w+b");
+  if (fp == NULL) {
+    fprintf(stderr, "error: can't write \"%s\"\n", name);
+    exit(1);
+  }
+  return fp;
+}
+
+// A range of first letters, merged by a thread of its own into a temporary
+// file, to be joined to the rest (see IndexWriter::add_part).
+struct Part {
+  std::string name;
+  FILE* fp;
+  IndexWriter writer;
+  thread runner;
+
+  Part(const char* name, std::vector<IndexReader*> const* inputs,
+       pair<int, int> range, int cutoff)
+      : name(name), fp(OpenPart(name)), writer(fp) {
+    Configure(&writer);
+    runner = thread(&Part::run, this, inputs, range, cutoff);
+  }
+
+  ~Part() {
+    fclose(fp);
+    remove(name.c_str());
+  }
+
+  void run(std::vector<IndexReader*> const* inputs, pair<int, int> range,
+           int cutoff) {
+    FrequencyCutoffWriter cutoff_writer(&writer, cutoff);
+    MergeRange(*inputs, range.first, range.second, &cutoff_writer);
+    cutoff_writer.end_part();
   }
 };
 
-struct FrequencyCutoffWriter {
-  FrequencyCutoffWriter(IndexWriter* out, int min):
-      output(out), cutoff(min), output_same(0) {
-    words.push_back(make_pair(0, 0));
+static IndexReader* OpenInput(const char* name) {
+  FILE *fp = fopen(name, "r");
+  if (fp == NULL) {
+    fprintf(stderr, "error: can't read \"%s\"\n", name);
+    exit(1);
   }
 
-  void next(const char *text, int same, int64_t count) {
-    if (text != NULL) {
-      while (same < int(saved.size()) && text[same] == saved[same]) ++same;
-      assert(memcmp(saved.c_str(), text, same) == 0);
-      assert(strcmp(saved.c_str() + same, text + same) <= 0);
-#if DEBUG
-      fprintf(stderr, "input: [%.*s|%s] * %d\n", same, text, text+same, count);
-#endif
-    }
+  IndexReader* index = new IndexReader(fp);
+  fclose(fp);
+  if (!index->scale().empty()) {
+    fprintf(stderr, "error: \"%s\" has approximate counts\n", name);
+    exit(1);
+  }
+  return index;
+}
+
+// Merges in passes of at most a given fan-in, for more inputs than can be
+// open at once: each pass merges groups of inputs into temporary files
+// (each group on a thread of its own, up to a limit at once), until few
+// enough are left for the final merge.  Only that applies the cutoff.
+class MergePasses {
+ public:
+  MergePasses(const char* out, size_t fan_in, int threads)
+      : out(out), fan_in(fan_in), threads(threads),
+        start(chrono::steady_clock::now()), bytes(0) {}
+
+  // Removes the last pass's files.
+  ~MergePasses() {
+    for (size_t i = 0; i < temps.size(); ++i) remove(temps[i].c_str());
+  }
 
-    assert(!words.empty());
-    while (words.back().first > (size_t) same) {
-      pair<size_t, int64_t> last_word = words.back();
-      words.pop_back();
-
-      assert(saved.size() >= last_word.first);
-      saved.resize(last_word.first);
-      output_same = min(output_same, saved.size());
-      if (last_word.second >= cutoff ||
-          (last_word.second > 0 && output_same == last_word.first)) {
-#if DEBUG
-        fprintf(stderr, "output: [%.*s|%s] * %d\n",
-            output_same, saved.c_str(),
-            saved.c_str()+output_same, last_word.second);
-#endif
-        output->next(saved.c_str(), output_same, last_word.second);
-        output_same = words.back().first;
-      } else {
-        words.back().second += last_word.second;
-        output_same = min(output_same, words.back().first);
+  std::vector<std::string> run(std::vector<std::string> inputs) {
+    for (int pass = 1; inputs.size() > fan_in; ++pass) {
+      // Groups of about equal size
+      size_t groups = (inputs.size() + fan_in - 1) / fan_in;
+      std::vector<std::vector<std::string> > members(groups);
+      for (size_t i = 0; i < inputs.size(); ++i)
+        members[i * groups / inputs.size()].push_back(inputs[i]);
+
+      std::vector<std::string> outputs;
+      for (size_t i = 0; i < groups; ++i) {
+        char name[out.size() + 32];
+        snprintf(name, sizeof(name), "%s.pass%d.%zu", out.c_str(), pass, i);
+        outputs.push_back(name);
       }
-    }
 
-    saved.resize(same);
-    if (text != NULL) {
-      saved.append(text + same);
-      while (const char *space = strchr(text + same, ' ')) {
-        same = space - text + 1;
-        words.push_back(make_pair(same, 0));
+      atomic<size_t> next(0);
+      std::vector<thread> pool;
+      for (int i = 0; i < threads && size_t(i) < groups; ++i) {
+        pool.push_back(thread([&] {
+          for (size_t g; (g = next++) < groups; ) {
+            int64_t size = Merge(members[g], outputs[g]);
+            report(pass, size, outputs[g]);
+          }
+        }));
       }
+      for (size_t i = 0; i < pool.size(); ++i) pool[i].join();
+
+      for (size_t i = 0; i < temps.size(); ++i) remove(temps[i].c_str());
+      temps = inputs = outputs;
     }
+    return inputs;
+  }
 
-    if (!words.empty()) words.back().second += count;
-    if (text == NULL) output->next(NULL, 0, 0);
+  // Notes that a merge of this many input bytes is done.
+  void report(int pass, int64_t size, std::string const& name) {
+    lock_guard<mutex> hold(lock);
+    bytes += size;
+    double seconds = chrono::duration<double>(
+        chrono::steady_clock::now() - start).count();
+    fprintf(stderr, "pass %d: merged %.1f MB into \"%s\", "
+        "%.1f MB in %.1fs (%.1f MB/s)\n", pass, size / 1048576.0,
+        name.c_str(), bytes / 1048576.0, seconds,
+        seconds > 0 ? bytes / 1048576.0 / seconds : 0.0);
   }
 
  private:
-  IndexWriter* const output;
-  const int cutoff;
-  size_t output_same;
-  std::string saved;
-  std::vector<pair<size_t, int64_t> > words;
+  const std::string out;
+  const size_t fan_in;
+  const int threads;
+  std::vector<std::string> temps;
+
+  mutex lock;
+  const chrono::steady_clock::time_point start;
+  int64_t bytes;
+
+  // Every count passes through (the lowest cutoff only drops empty words),
+  // so the final merge sees the same texts it would have seen in the
+  // inputs.  Returns the bytes read.
+  static int64_t Merge(std::vector<std::string> const& names,
+                       std::string const& name) {
+    int64_t size = 0;
+    std::vector<IndexReader*> readers;
+    std::vector<IndexWalker*> walkers;
+    for (size_t i = 0; i < names.size(); ++i) {
+      readers.push_back(OpenInput(names[i].c_str()));
+      size += readers.back()->size();
+      walkers.push_back(new IndexWalker(
+          readers.back(), readers.back()->root(), readers.back()->count()));
+    }
+
+    FILE *fp = fopen(name.c_str(), "wb");
+    if (fp == NULL) {
+      fprintf(stderr, "error: can't write \"%s\"\n", name.c_str());
+      exit(1);
+    }
+
+    IndexWriter output(fp);
+    output.set_background(true);
+    FrequencyCutoffWriter writer(&output, 1);
+    for (WalkerMerge merge(walkers); merge.text != NULL; merge.next())
+      writer.next(merge.text, merge.same, merge.count);
+    writer.next(NULL, 0, 0);
+    if (fclose(fp) != 0) {
+      fprintf(stderr, "error: can't write \"%s\"\n", name.c_str());
+      exit(1);
+    }
+
+    for (size_t i = 0; i < readers.size(); ++i) delete readers[i];
+    return size;
+  }
 };
 
+static void usage(char const* argv0) {
+  fprintf(stderr, "usage: %s [-c] [-d] [-f fan_in] [-n shards] [-q] "
+      "[-s span] [-t threads] min input.index ... out.index\n", argv0);
+}
+
 int main(int argc, char *argv[]) {
-  if (argc < 4) {
-    fprintf(stderr, "usage: %s min input.index ... out.index\n", argv[0]);
+  bool approximate = false;
+  int shards = 1, threads = 1, fan_in = 0;
+  int opt;
+  while ((opt = getopt(argc, argv, "cdf:n:qs:t:")) != -1) {
+    switch (opt) {
+      case 'c': compact = true; break;
+      case 'd': shared = true; break;
+      case 'f': fan_in = atoi(optarg); break;
+      case 'n': shards = atoi(optarg); break;
+      case 'q': approximate = true; break;
+      case 's': summary_span = atoll(optarg); break;
+      case 't': threads = atoi(optarg); break;
+      default:
+        usage(argv[0]);
+        return 2;
+    }
+  }
+
+  if (argc - optind < 3 || (fan_in != 0 && fan_in < 2) || shards < 1 ||
+      shards > 256 || summary_span < 0 || threads < 1 || threads > 256) {
+    usage(argv[0]);
     return 2;
   }
 
+  // Drop the options, so the remaining arguments start at argv[1].
+  argv[optind - 1] = argv[0];
+  argc -= optind - 1;
+  argv += optind - 1;
+
   int cutoff = atoi(argv[1]);
   if (cutoff <= 0) {
     fprintf(stderr, "error: illegal frequency threshold \"%s\"\n", argv[1]);
     return 2;
   }
 
-  priority_queue<IndexWalker*, std::vector<IndexWalker*>, ReaderCompare> queue;
-  for (int i = 2; i < argc - 1; ++i) {
-    FILE *fp = fopen(argv[i], "r");
-    if (fp == NULL) {
-      fprintf(stderr, "error: can't read \"%s\"\n", argv[i]);
+  std::vector<std::string> outputs;
+  for (int shard = 0; shard < shards; ++shard) {
+    outputs.push_back((shards == 1) ? std::string(argv[argc - 1]) :
+        IndexShards::shard_name(argv[argc - 1], shard));
+    if (fopen(outputs.back().c_str(), "rb") != NULL) {
+      fprintf(stderr, "error: output \"%s\" already exists\n",
+          outputs.back().c_str());
       return 1;
     }
+  }
 
-    IndexReader* index = new IndexReader(fp);
-    IndexWalker* walker = new IndexWalker(index, index->root(), index->count());
-    if (walker->text == NULL) {
-      fprintf(stderr, "warning: empty input \"%s\"\n", argv[i]);
-      delete walker;
-    } else {
-      queue.push(walker);
+  // With a fan-in limit, merge down to that many inputs first
+  std::vector<std::string> names(argv + 2, argv + argc - 1);
+  MergePasses passes(argv[argc - 1], fan_in ? fan_in : names.size(), threads);
+  names = passes.run(names);
+  bool report = int(names.size()) < argc - 3;
+  const auto start = chrono::steady_clock::now();
+
+  std::vector<IndexReader*> inputs;
+  int64_t total = 0, first[256] = { 0 }, bytes = 0;
+  for (size_t i = 0; i < names.size(); ++i) {
+    IndexReader* index = OpenInput(names[i].c_str());
+    bytes += index->size();
+    if (index->root() == -1) {
+      fprintf(stderr, "warning: empty input \"%s\"\n", names[i].c_str());
+      continue;
     }
-  }
 
-  if (fopen(argv[argc - 1], "rb") != NULL) {
-    fprintf(stderr, "error: output \"%s\" already exists\n", argv[argc - 1]);
-    return 1;
+    total += index->count();
+    std::vector<IndexReader::Choice> top;
+    index->children(index->root(), index->count(), CHAR_MIN, CHAR_MAX, &top);
+    for (size_t j = 0; j < top.size(); ++j)
+      first[(unsigned char) top[j].ch] += top[j].count;
+    inputs.push_back(index);
   }
 
-  FILE *out = fopen(argv[argc - 1], "wb");
-  if (out == NULL) {
-    fprintf(stderr, "error: can't write \"%s\"\n", argv[argc - 1]);
-    return 1;
-  }
-  IndexWriter output(out);
-  FrequencyCutoffWriter writer(&output, cutoff);
+  if (approximate) scale = IndexWriter::log_scale(total);
 
-  while (!queue.empty()) {
-    IndexWalker *next = queue.top(); queue.pop();
-    writer.next(next->text, next->same, next->count);
-    next->next();
-    if (next->text == NULL)
-      delete next;
-    else
-      queue.push(next);
+  int shard_of[256];
+  IndexShards::partition(first, shards, shard_of);
+
+  for (int shard = 0; shard < shards; ++shard) {
+    std::string const& name = outputs[shard];
+    FILE *out = fopen(name.c_str(), "wb");
+    if (out == NULL) {
+      fprintf(stderr, "error: can't write \"%s\"\n", name.c_str());
+      return 1;
+    }
+    IndexWriter output(out);
+    output.set_background(true);
+    Configure(&output);
+
+    // Split the shard's letters into ranges of about equal frequency, one
+    // for each thread (never across 0x80, where char turns negative)
+    std::vector<pair<int, int> > ranges;
+    int64_t shard_total = 0, sofar = 0;
+    for (int ch = 0; ch < 256; ++ch)
+      if (shard_of[ch] == shard) shard_total += first[ch];
+    for (int ch = 0; ch < 256; ++ch) {
+      if (shard_of[ch] != shard || first[ch] == 0) continue;
+      if (ranges.empty() || (ch >= 0x80 && ranges.back().second < 0x80) ||
+          (int(ranges.size()) < threads &&
+           sofar >= int64_t(ranges.size()) * (shard_total / threads)))
+        ranges.push_back(make_pair(ch, ch));
+      ranges.back().second = ch;
+      sofar += first[ch];
+    }
+
+    if (ranges.size() <= 1) {
+      FrequencyCutoffWriter writer(&output, cutoff);
+      if (!ranges.empty())
+        MergeRange(inputs, ranges[0].first, ranges[0].second, &writer);
+      writer.next(NULL, 0, 0);
+    } else {
+      // Each thread merges its range into a part file of its own
+      std::vector<Part*> parts;
+      for (size_t i = 0; i < ranges.size(); ++i) {
+        char part_name[name.size() + 32];
+        snprintf(part_name, sizeof(part_name), "%s.part%zu", name.c_str(), i);
+        parts.push_back(new Part(part_name, &inputs, ranges[i], cutoff));
+      }
+
+      for (size_t i = 0; i < parts.size(); ++i) {
+        parts[i]->runner.join();
+        output.add_part(&parts[i]->writer);
+        delete parts[i];
+      }
+      output.next(NULL, 0, 0);
+    }
+
+    if (fclose(out) != 0) {
+      fprintf(stderr, "error: can't write \"%s\"\n", name.c_str());
+      return 1;
+    }
   }
 
-  writer.next(NULL, 0, 0);
+  if (report) {
+    double seconds = chrono::duration<double>(
+        chrono::steady_clock::now() - start).count();
+    fprintf(stderr, "final pass: merged %.1f MB in %.1fs (%.1f MB/s)\n",
+        bytes / 1048576.0, seconds,
+        seconds > 0 ? bytes / 1048576.0 / seconds : 0.0);
+  }
   return 0;
 }
@@ -0,0 +1,85 @@
+// Apply a higher frequency cutoff to an index, as merging it again with
+// merge-indexes would (the output is the same), but without walking every
+// text (see IndexPruner).
+
+#include "index.h"
+
+#include <inttypes.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+static void usage(char const* argv0) {
+  fprintf(stderr, "usage: %s [-c] [-d] [-s span] min input.index "
+      "output.index\n", argv0);
+}
+
+int main(int argc, char *argv[]) {
+  off_t summary_span = 0;
+  bool compact = false, shared = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "cds:")) != -1) {
+    switch (opt) {
+      case 'c': compact = true; break;
+      case 'd': shared = true; break;
+      case 's': summary_span = atoll(optarg); break;
+      default:
+        usage(argv[0]);
+        return 2;
+    }
+  }
+
+  if (optind != argc - 3 || summary_span < 0) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  int64_t cutoff = atoll(argv[optind]);
+  if (cutoff <= 0) {
+    fprintf(stderr, "error: illegal frequency threshold \"%s\"\n",
+        argv[optind]);
+    return 2;
+  }
+
+  FILE *fp = fopen(argv[optind + 1], "rb");
+  if (fp == NULL) {
+    fprintf(stderr, "error: can't read \"%s\"\n", argv[optind + 1]);
+    return 1;
+  }
+
+  IndexReader input(fp);
+  fclose(fp);
+  if (!input.scale().empty()) {
+    fprintf(stderr, "error: \"%s\" has approximate counts\n",
+        argv[optind + 1]);
+    return 1;
+  }
+
+  const char* out_file = argv[optind + 2];
+  if (fopen(out_file, "rb") != NULL) {
+    fprintf(stderr, "error: output \"%s\" already exists\n", out_file);
+    return 1;
+  }
+
+  FILE *out = fopen(out_file, "wb");
+  if (out == NULL) {
+    fprintf(stderr, "error: can't write \"%s\"\n", out_file);
+    return 1;
+  }
+
+  IndexWriter output(out);
+  output.set_background(true);
+  output.set_summary_span(summary_span);
+  output.set_compact(compact);
+  output.set_shared(shared ? 1 << 20 : 0);
+  IndexPruner pruner(&input, &output, cutoff);
+  pruner.run();
+  if (fclose(out) != 0) {
+    fprintf(stderr, "error: can't write \"%s\"\n", out_file);
+    return 1;
+  }
+
+  fprintf(stderr, "skipped %" PRId64 " subtrees under %" PRId64 "\n",
+      pruner.skipped_subtrees(), cutoff);
+  return 0;
+}
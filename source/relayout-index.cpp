@@ -0,0 +1,273 @@
+// Rewrite a Nutrimatic index file so the most frequent nodes sit together
+// at the end of the file, next to the root, instead of being scattered
+// through it in alphabetical order.  The node formats are unchanged.
+//
+// The hot nodes are found best-first from the root (the way searches
+// explore), up to a budget.  Every cold subtree hanging off them is copied
+// first, whole, then the hot nodes follow.  Both passes visit the hot nodes
+// in the same order, children before parents and the most frequent child
+// last, so subtrees and siblings stay together and each node's most
+// frequent child is closest to it.
+//
+// Given a file of sample queries (one text per line), reports how many
+// pages each version of the index touches to look up each text and then
+// expand the most frequent nodes below it.
+
+#include "index.h"
+
+#include <assert.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <queue>
+#include <set>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+using namespace std;
+
+static bool by_count(IndexReader::Choice const& a,
+                     IndexReader::Choice const& b) {
+  return a.count < b.count;
+}
+
+class Relayout {
+ public:
+  Relayout(IndexReader const* in, IndexWriter* out): input(in), output(out) {}
+
+  void run(size_t hot_nodes) {
+    IndexReader::Node root = input->root();
+    if (root == -1) {
+      output->finish(-1, input->count());
+      return;
+    }
+
+    // Find the hot nodes, and the cold subtrees just below them
+    typedef pair<int64_t, IndexReader::Node> Unit;
+    priority_queue<Unit> queue;
+    queue.push(make_pair(input->count(), root));
+    vector<IndexReader::Choice> choices;
+    while (!queue.empty()) {
+      Unit unit = queue.top(); queue.pop();
+      if (hot.size() >= hot_nodes) {
+        written[unit.second] = -1;
+        continue;
+      }
+
+      // A chain of single letter nodes goes with its top, so it is copied
+      // in one piece and keeps its one-byte form.
+      for (;;) {
+        hot.insert(unit.second);
+        written[unit.second] = -1;
+        choices.clear();
+        input->children(unit.second, unit.first, CHAR_MIN, CHAR_MAX, &choices);
+        if (choices.size() != 1 || choices[0].next == -1 ||
+            choices[0].count != unit.first || choices[0].ch < 0x20) break;
+        unit.second = choices[0].next;
+      }
+
+      for (size_t i = 0; i < choices.size(); ++i)
+        if (choices[i].next != -1)
+          queue.push(make_pair(choices[i].count, choices[i].next));
+    }
+
+    copy_cold(root, input->count());
+    output->finish(copy(root, input->count()), input->count());
+  }
+
+ private:
+  IndexReader const* const input;
+  IndexWriter* const output;
+
+  // Hot nodes, and the new positions of hot nodes and cold subtrees (-1
+  // until written).
+  unordered_set<IndexReader::Node> hot;
+  unordered_map<IndexReader::Node, IndexReader::Node> written;
+
+  void copy_cold(IndexReader::Node node, int64_t count) {
+    if (hot.count(node) == 0) {
+      copy(node, count);
+      return;
+    }
+
+    vector<IndexReader::Choice> choices;
+    input->children(node, count, CHAR_MIN, CHAR_MAX, &choices);
+    stable_sort(choices.begin(), choices.end(), by_count);
+    for (size_t i = 0; i < choices.size(); ++i)
+      if (choices[i].next != -1) copy_cold(choices[i].next, choices[i].count);
+  }
+
+  IndexReader::Node copy(IndexReader::Node node, int64_t count) {
+    unordered_map<IndexReader::Node, IndexReader::Node>::iterator it =
+        written.find(node);
+    if (it != written.end() && it->second != -1) return it->second;
+
+    IndexReader::Cursor cursor;
+    input->cursor(node, count, CHAR_MIN, CHAR_MAX, &cursor);
+    bool summarized = cursor.summarized;
+    IndexReader::Summary summary = cursor.summary;
+    vector<IndexReader::Choice> choices;
+    while (cursor.next()) choices.push_back(cursor.choice);
+
+    // Copy the children in order of frequency, the node's own entries
+    // staying in letter order
+    vector<pair<int64_t, size_t> > order;
+    for (size_t i = 0; i < choices.size(); ++i)
+      order.push_back(make_pair(choices[i].count, i));
+    sort(order.begin(), order.end());
+
+    for (size_t i = 0; i < order.size(); ++i) {
+      IndexReader::Choice* choice = &choices[order[i].second];
+      if (choice->next != -1) choice->next = copy(choice->next, choice->count);
+    }
+
+    IndexReader::Node pos = output->copy_node(
+        choices, cursor.count, summarized ? &summary : NULL);
+    if (it != written.end()) it->second = pos;
+    return pos;
+  }
+};
+
+// Look up a text, then expand the most frequent nodes below it, noting the
+// pages touched.
+static void Touch(IndexReader const& reader, const char* text, int expand,
+                  set<off_t>* pages) {
+  const long page = sysconf(_SC_PAGESIZE);
+  IndexReader::Node node = reader.root();
+  int64_t count = reader.count();
+  vector<IndexReader::Choice> choices;
+  for (; *text != '\0' && node != -1; ++text) {
+    pages->insert((node - 1) / page);
+    choices.clear();
+    reader.children(node, count, *text, *text, &choices);
+    if (choices.empty()) return;
+    node = choices[0].next;
+    count = choices[0].count;
+  }
+
+  priority_queue<pair<int64_t, IndexReader::Node> > queue;
+  if (node != -1) queue.push(make_pair(count, node));
+  for (int i = 0; i < expand && !queue.empty(); ++i) {
+    node = queue.top().second;
+    count = queue.top().first;
+    queue.pop();
+    pages->insert((node - 1) / page);
+    choices.clear();
+    reader.children(node, count, CHAR_MIN, CHAR_MAX, &choices);
+    for (size_t j = 0; j < choices.size(); ++j)
+      if (choices[j].next != -1)
+        queue.push(make_pair(choices[j].count, choices[j].next));
+  }
+}
+
+static void Report(const char* name, IndexReader const& reader,
+                   vector<string> const& queries, int expand) {
+  const long page = sysconf(_SC_PAGESIZE);
+  set<off_t> all;
+  int64_t touched = 0;
+  for (size_t i = 0; i < queries.size(); ++i) {
+    set<off_t> pages;
+    Touch(reader, queries[i].c_str(), expand, &pages);
+    touched += pages.size();
+    all.insert(pages.begin(), pages.end());
+  }
+
+  off_t span = all.empty() ? 0 : (*all.rbegin() - *all.begin() + 1);
+  printf("%s: %.1f pages per query, %zu pages in all, spanning %.1f MB\n",
+      name, queries.empty() ? 0.0 : double(touched) / queries.size(),
+      all.size(), double(span) * page / (1 << 20));
+}
+
+static void usage(char const* argv0) {
+  fprintf(stderr, "usage: %s [-c] [-n hot_nodes] [-q queries.txt "
+      "[-x expand]] input.index output.index\n", argv0);
+}
+
+int main(int argc, char *argv[]) {
+  size_t hot_nodes = 1 << 15;
+  const char* query_file = NULL;
+  int expand = 100;
+  bool compact = false;
+  int opt;
+  while ((opt = getopt(argc, argv, "cn:q:x:")) != -1) {
+    switch (opt) {
+      case 'c': compact = true; break;
+      case 'n': hot_nodes = atoll(optarg); break;
+      case 'q': query_file = optarg; break;
+      case 'x': expand = atoi(optarg); break;
+      default:
+        usage(argv[0]);
+        return 2;
+    }
+  }
+
+  if (optind != argc - 2) {
+    usage(argv[0]);
+    return 2;
+  }
+
+  FILE *fp = fopen(argv[optind], "r");
+  if (fp == NULL) {
+    fprintf(stderr, "error: can't open \"%s\"\n", argv[optind]);
+    return 1;
+  }
+
+  vector<string> queries;
+  if (query_file != NULL) {
+    FILE *qf = fopen(query_file, "r");
+    if (qf == NULL) {
+      fprintf(stderr, "error: can't open \"%s\"\n", query_file);
+      return 1;
+    }
+
+    char line[1024];
+    while (fgets(line, sizeof(line), qf) != NULL) {
+      line[strcspn(line, "\n")] = '\0';
+      queries.push_back(line);
+    }
+    fclose(qf);
+  }
+
+  const char* out_file = argv[optind + 1];
+  if (fopen(out_file, "rb") != NULL) {
+    fprintf(stderr, "error: output \"%s\" already exists\n", out_file);
+    return 1;
+  }
+
+  FILE *out = fopen(out_file, "wb");
+  if (out == NULL) {
+    fprintf(stderr, "error: can't write \"%s\"\n", out_file);
+    return 1;
+  }
+
+  IndexReader input(fp);
+  IndexWriter output(out);
+  output.set_compact(compact);
+  output.set_scale(input.scale());
+  Relayout(&input, &output).run(hot_nodes);
+  if (fclose(out) != 0) {
+    fprintf(stderr, "error: can't write \"%s\"\n", out_file);
+    return 1;
+  }
+
+  if (!queries.empty()) {
+    FILE *rp = fopen(out_file, "r");
+    if (rp == NULL) {
+      fprintf(stderr, "error: can't open \"%s\"\n", out_file);
+      return 1;
+    }
+
+    IndexReader result(rp);
+    Report("Input", input, queries, expand);
+    Report("Output", result, queries, expand);
+  }
+
+  return 0;
+}
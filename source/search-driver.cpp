@@ -3,87 +3,1223 @@
 
 #include <assert.h>
 #include <limits.h>
+#include <math.h>
+#include <string.h>
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <unordered_map>
 
 using namespace std;
 
+static const size_t BLOCK_SIZE = 1 << 16;
+
+// Cursors (see SearchDriver::save) hold LEB128 varints, as index nodes do,
+// and doubles as eight bytes, little-endian.
+static const char CURSOR_MAGIC[8] = { 'N', 'U', 'T', 'R', 'C', 'U', 'R', 0 };
+static const uint64_t CURSOR_VERSION = 3;
+
+static void put_varint(uint64_t value, FILE* fp) {
+  for (; value >= 0x80; value >>= 7) putc((value & 0x7F) | 0x80, fp);
+  putc(value, fp);
+}
+
+static bool get_varint(FILE* fp, uint64_t* value) {
+  *value = 0;
+  for (int shift = 0; shift < 64; shift += 7) {
+    const int c = getc(fp);
+    if (c == EOF) return false;
+    *value |= uint64_t(c & 0x7F) << shift;
+    if (!(c & 0x80)) return true;
+  }
+  return false;
+}
+
+static void put_double(double value, FILE* fp) {
+  uint64_t bits;
+  memcpy(&bits, &value, sizeof(bits));
+  for (int i = 0; i < 8; ++i) putc(bits >> (i * 8), fp);
+}
+
+static bool get_double(FILE* fp, double* value) {
+  uint64_t bits = 0;
+  for (int i = 0; i < 8; ++i) {
+    const int c = getc(fp);
+    if (c == EOF) return false;
+    bits |= uint64_t(c) << (i * 8);
+  }
+  memcpy(value, &bits, sizeof(bits));
+  return true;
+}
+
+static bool text_before(const char* a, const char* b) {
+  return strcmp(a, b) < 0;
+}
+
+// True if fp is past end (unless end is zero, for no limit).
+static bool past(FILE* fp, long end) {
+  return end > 0 && ftell(fp) > end;
+}
+
+static bool corrupt() {
+  fprintf(stderr, "error: search cursor is cut short or corrupt\n");
+  return false;
+}
+
+TextSet::TextSet(): slots(1024), count(0), space(NULL), space_left(0) {}
+
+TextSet::~TextSet() {
+  for (size_t i = 0; i < blocks.size(); ++i) delete[] blocks[i];
+}
+
+const char* TextSet::insert(const char* text, size_t len) {
+  uint64_t hash = 14695981039346656037ULL;  // FNV-1a
+  for (size_t i = 0; i < len; ++i)
+    hash = (hash ^ (unsigned char) text[i]) * 1099511628211ULL;
+
+  const size_t mask = slots.size() - 1;
+  size_t i = hash & mask;
+  for (; slots[i].text != NULL; i = (i + 1) & mask) {
+    if (slots[i].hash == hash && !strncmp(slots[i].text, text, len) &&
+        slots[i].text[len] == '\0')
+      return NULL;
+  }
+
+  char* copy = allocate(len + 1);
+  memcpy(copy, text, len);
+  copy[len] = '\0';
+  slots[i].hash = hash;
+  slots[i].text = copy;
+  if (++count * 2 > slots.size()) grow();
+  return copy;
+}
+
+char* TextSet::allocate(size_t size) {
+  if (size > space_left) {
+    // Texts too long to share a block get one of their own.
+    const size_t block_size = max(size, BLOCK_SIZE);
+    blocks.push_back(new char[block_size]);
+    space = blocks.back();
+    space_left = block_size;
+  }
+
+  char* out = space;
+  space += size;
+  space_left -= size;
+  return out;
+}
+
+std::vector<const char*> TextSet::texts() const {
+  std::vector<const char*> out;
+  out.reserve(count);
+  for (size_t i = 0; i < slots.size(); ++i)
+    if (slots[i].text != NULL) out.push_back(slots[i].text);
+  return out;
+}
+
+void TextSet::grow() {
+  vector<Slot> old(slots.size() * 2);
+  old.swap(slots);
+
+  const size_t mask = slots.size() - 1;
+  for (size_t i = 0; i < old.size(); ++i) {
+    if (old[i].text == NULL) continue;
+    size_t j = old[i].hash & mask;
+    while (slots[j].text != NULL) j = (j + 1) & mask;
+    slots[j] = old[i];
+  }
+}
+
+// One shard's search, run in its own thread, feeding results to the driver
+// that merges them.
+struct SearchDriver::Worker {
+  SearchDriver* driver;
+  thread runner;
+  mutex lock;
+  condition_variable changed;
+  deque<pair<double, string> > results;
+  atomic<int64_t> steps;
+  atomic<double> discarded;
+  atomic<bool> stop;
+  bool done;
+
+  void run() {
+    // don't get too far ahead of the other shards
+    static const size_t most = 256;
+    for (;;) {
+      while (!stop && !driver->step()) {
+        steps.store(driver->steps, memory_order_relaxed);
+        // now and then, so that gather() can report progress
+        if (driver->steps % 4096 == 0) changed.notify_all();
+      }
+      steps.store(driver->steps, memory_order_relaxed);
+      discarded.store(driver->discarded, memory_order_relaxed);
+
+      unique_lock<mutex> hold(lock);
+      while (!stop && driver->text != NULL && results.size() >= most)
+        changed.wait(hold);
+      if (stop) return;
+      if (driver->text == NULL) {
+        done = true;
+        changed.notify_all();
+        return;
+      }
+
+      results.push_back(make_pair(driver->score, string(driver->text)));
+      changed.notify_all();
+    }
+  }
+};
+
+// The nodes and results of a search shared between threads.  The nodes are
+// in a few queues per thread, each with its own lock: a thread adds the
+// children of a node to one queue at random, and takes the better of the
+// best of two queues at random, so threads seldom wait on each other and
+// still take nodes near the best overall.  Results wait in a heap until
+// the driver that owns the pool finds that nothing left can beat them.
+struct SearchDriver::Pool {
+  struct Queue {
+    mutex lock;
+    Frontier nodes;
+    atomic<double> best;  // As nodes.best(), for choosing without the lock
+  };
+
+  struct Helper {
+    SearchDriver* driver;
+    thread runner;
+    mutex busy;  // Held while taking, expanding and adding nodes
+    atomic<int64_t> steps;
+  };
+
+  vector<Queue*> queues;
+  vector<Helper*> helpers;
+  double slack;
+  atomic<bool> pausing;  // Helpers wait between nodes while set
+  atomic<bool> stop;
+
+  // Each text found, with the best node it was found at so far (if another
+  // was better, it's in results twice), and if it was handed out yet.
+  struct Found {
+    Next next;
+    bool out;
+  };
+  typedef unordered_map<string, Found> Seen;
+
+  mutex lock;  // For the results
+  Seen seen;
+  priority_queue<pair<double, Seen::value_type*> > results;
+  double bound;  // No node left scores higher; -1 if none are left
+
+  ~Pool() {
+    stop = true;
+    for (size_t i = 0; i < helpers.size(); ++i) {
+      if (helpers[i]->runner.joinable()) helpers[i]->runner.join();
+      helpers[i]->driver->pool = NULL;  // Not theirs to delete
+      delete helpers[i]->driver;
+      delete helpers[i];
+    }
+    for (size_t i = 0; i < queues.size(); ++i) delete queues[i];
+  }
+
+  Queue* choose(uint64_t* random) {
+    *random ^= *random << 13;  // xorshift64
+    *random ^= *random >> 7;
+    *random ^= *random << 17;
+    return queues[*random % queues.size()];
+  }
+
+  bool pop(Next* next, uint64_t* random) {
+    for (size_t tries = 0; tries < queues.size(); ++tries) {
+      Queue* a = choose(random);
+      Queue* b = choose(random);
+      double best = a->best.load(memory_order_relaxed);
+      if (b->best.load(memory_order_relaxed) > best) {
+        a = b;
+        best = b->best.load(memory_order_relaxed);
+      }
+      if (best < 0) continue;
+      unique_lock<mutex> hold(a->lock, try_to_lock);
+      if (!hold.owns_lock() || a->nodes.empty()) continue;
+      a->nodes.pop(next);
+      a->best.store(a->nodes.best(), memory_order_relaxed);
+      return true;
+    }
+
+    // Few queues have anything (or all were busy), so try each in turn.
+    for (size_t i = 0; i < queues.size(); ++i) {
+      lock_guard<mutex> hold(queues[i]->lock);
+      if (queues[i]->nodes.empty()) continue;
+      queues[i]->nodes.pop(next);
+      queues[i]->best.store(queues[i]->nodes.best(), memory_order_relaxed);
+      return true;
+    }
+    return false;
+  }
+
+  void push(vector<Next> const& nexts, uint64_t* random) {
+    Queue* queue = choose(random);
+    lock_guard<mutex> hold(queue->lock);
+    for (size_t i = 0; i < nexts.size(); ++i) queue->nodes.push(nexts[i]);
+    queue->best.store(queue->nodes.best(), memory_order_relaxed);
+  }
+
+  void run(Helper* helper) {
+    SearchDriver* driver = helper->driver;
+    while (!stop) {
+      if (pausing) {
+        this_thread::yield();
+        continue;
+      }
+
+      unique_lock<mutex> hold(helper->busy);
+      Next next;
+      if (!pop(&next, &driver->random)) {
+        // Others may yet add more.
+        hold.unlock();
+        this_thread::sleep_for(chrono::microseconds(100));
+        continue;
+      }
+
+      driver->expand(next);
+      if (!driver->pending.empty()) push(driver->pending, &driver->random);
+      driver->pending.clear();
+      helper->steps.store(++driver->steps, memory_order_relaxed);
+    }
+  }
+
+  // Finds the bound, with every helper between nodes, and sums up their
+  // progress.  With no nodes left, the helpers are told to stop.
+  void check(int64_t* steps, double* discarded) {
+    pausing = true;
+    vector<unique_lock<mutex> > holds;
+    for (size_t i = 0; i < helpers.size(); ++i)
+      holds.push_back(unique_lock<mutex>(helpers[i]->busy));
+
+    double best = -1;
+    *discarded = 0;
+    for (size_t i = 0; i < queues.size(); ++i) {
+      best = max(best, queues[i]->best.load(memory_order_relaxed));
+      *discarded += queues[i]->nodes.discarded();
+    }
+    *steps = 0;
+    for (size_t i = 0; i < helpers.size(); ++i)
+      *steps += helpers[i]->steps.load(memory_order_relaxed);
+    if (best < 0) stop = true;
+
+    holds.clear();
+    pausing = false;
+    lock_guard<mutex> hold(lock);
+    bound = best;
+  }
+
+  // True if the best result can be handed out (call with lock held).
+  bool ready() const {
+    return !results.empty() &&
+        (bound < 0 || results.top().first * (1 + slack) >= bound);
+  }
+};
+
+SearchDriver::Crumbs::Crumbs(): count(0) {
+  for (int b = 0; b < 32; ++b) blocks[b] = NULL;
+}
+
+SearchDriver::Crumbs::~Crumbs() {
+  for (int b = 0; b < 32; ++b) delete[] blocks[b].load();
+}
+
+int SearchDriver::Crumbs::add(Crumb const& crumb) {
+  const int i = count.fetch_add(1, memory_order_relaxed);
+  *slot(i) = crumb;
+  return i;
+}
+
+// A word crumb is followed by its scale, in the next crumb's place.
+int SearchDriver::Crumbs::add_word(Crumb const& crumb, double scale) {
+  static_assert(sizeof(Crumb) == sizeof(scale), "a scale fills a crumb");
+  const int i = count.fetch_add(2, memory_order_relaxed);
+  *slot(i) = crumb;
+  slot(i)->word = true;
+  memcpy(slot(i + 1), &scale, sizeof(scale));
+  return i;
+}
+
+double SearchDriver::Crumbs::scale(int i) const {
+  while (i >= 0 && !(*this)[i].word) i = (*this)[i].parent;
+  if (i < 0) return 1.0;  // Only from a corrupt cursor
+  double scale;
+  memcpy(&scale, &(*this)[i + 1], sizeof(scale));
+  return scale;
+}
+
+SearchDriver::Crumb* SearchDriver::Crumbs::slot(int i) {
+  const int b = block(i);
+  Crumb* to = blocks[b].load(memory_order_acquire);
+  if (to == NULL) {
+    // The first to need the block makes it.
+    Crumb* made = new Crumb[FIRST << b];
+    if (blocks[b].compare_exchange_strong(to, made, memory_order_acq_rel))
+      to = made;
+    else
+      delete[] made;
+  }
+  return &to[i + FIRST - (FIRST << b)];
+}
+
 SearchDriver::SearchDriver(const IndexReader* r,
                            const SearchFilter* f,
                            SearchFilter::State start,
                            double rp):
-    reader(r), filter(f), restart(rp) {
+    text(NULL), score(0), steps(0), discarded(0), crumbs(local_crumbs),
+    readers(1, r), overlay(NULL), total(r->count()), filter(f), restart(rp),
+    pool(NULL), random(0x9e3779b97f4a7c15ULL) {
+  seed(0, start);
+}
+
+SearchDriver::SearchDriver(std::vector<const IndexReader*> const& shards,
+                           const SearchFilter* f,
+                           SearchFilter::State start,
+                           double rp):
+    text(NULL), score(0), steps(0), discarded(0), crumbs(local_crumbs),
+    readers(shards), overlay(NULL), total(0), filter(f), restart(rp),
+    pool(NULL), random(0x9e3779b97f4a7c15ULL) {
+  start_shards(start);
+}
+
+SearchDriver::SearchDriver(IndexShards const& index,
+                           const SearchFilter* f,
+                           SearchFilter::State start,
+                           double rp):
+    text(NULL), score(0), steps(0), discarded(0), crumbs(local_crumbs),
+    readers(index.readers()), overlay(index.overlay()), total(0), filter(f),
+    restart(rp), pool(NULL), random(0x9e3779b97f4a7c15ULL) {
+  if (overlay == NULL) {
+    start_shards(start);
+  } else {
+    total = overlay->count();
+    seed(0, start);
+  }
+}
+
+void SearchDriver::start_shards(SearchFilter::State start) {
+  assert(!readers.empty());
+  for (size_t i = 0; i < readers.size(); ++i) total += readers[i]->count();
+  if (readers.size() == 1) {
+    seed(0, start);
+    return;
+  }
+
+  for (size_t i = 0; i < readers.size(); ++i) {
+    Worker* worker = new Worker;
+    worker->driver = new SearchDriver(readers, i, filter, start, restart);
+    worker->steps = 0;
+    worker->discarded = 0;
+    worker->stop = false;
+    worker->done = false;
+    workers.push_back(worker);
+  }
+}
+
+SearchDriver::SearchDriver(std::vector<const IndexReader*> const& shards,
+                           int shard,
+                           const SearchFilter* f,
+                           SearchFilter::State start,
+                           double rp):
+    text(NULL), score(0), steps(0), discarded(0), crumbs(local_crumbs),
+    readers(shards), overlay(NULL), total(0), filter(f), restart(rp),
+    pool(NULL), random(0x9e3779b97f4a7c15ULL) {
+  for (size_t i = 0; i < shards.size(); ++i) total += shards[i]->count();
+  seed(shard, start);
+}
+
+SearchDriver::SearchDriver(SearchDriver& main, Pool* p):
+    text(NULL), score(0), steps(0), discarded(0), crumbs(main.crumbs),
+    readers(main.readers), overlay(NULL), total(main.total),
+    filter(main.filter), restart(main.restart),
+    pool(p), random(0x9e3779b97f4a7c15ULL * (p->helpers.size() + 1)) {}
+
+SearchDriver::~SearchDriver() {
+  delete pool;
+  for (size_t i = 0; i < workers.size(); ++i) {
+    lock_guard<mutex> hold(workers[i]->lock);
+    workers[i]->stop = true;
+    workers[i]->changed.notify_all();
+  }
+
+  for (size_t i = 0; i < workers.size(); ++i) {
+    if (workers[i]->runner.joinable()) workers[i]->runner.join();
+    delete workers[i]->driver;
+    delete workers[i];
+  }
+}
+
+void SearchDriver::set_beam(size_t entries) {
+  nexts.limit = entries;
+  const size_t n = workers.size();
+  for (size_t i = 0; i < n; ++i) {
+    assert(!workers[i]->runner.joinable());
+    workers[i]->driver->set_beam((entries + n - 1) / n);  // Zero stays zero
+  }
+
+  if (pool != NULL) {
+    const size_t q = pool->queues.size();
+    for (size_t i = 0; i < q; ++i)
+      pool->queues[i]->nodes.limit = (entries + q - 1) / q;
+  }
+}
+
+void SearchDriver::set_threads(int threads, double slack) {
+  if (threads < 2 || !workers.empty() || overlay != NULL) return;
+  assert(pool == NULL);
+  pool = new Pool;
+  pool->slack = slack;
+  pool->pausing = false;
+  pool->stop = false;
+  pool->bound = HUGE_VAL;  // Until the first check
+  for (int i = 0; i < threads * 2; ++i) {
+    pool->queues.push_back(new Pool::Queue);
+    pool->queues.back()->best = -1;
+  }
+  set_beam(nexts.limit);
+
+  while (!nexts.empty()) {
+    pending.resize(1);
+    nexts.pop(&pending[0]);
+    pool->push(pending, &random);
+  }
+  pending.clear();
+
+  // Results from before (as after resume()) aren't to come again.
+  std::vector<const char*> had = seen.texts();
+  for (size_t i = 0; i < had.size(); ++i) {
+    Pool::Found found = { Next(), true };
+    pool->seen.insert(make_pair(string(had[i]), found));
+  }
+
+  for (int i = 0; i < threads; ++i) {
+    Pool::Helper* helper = new Pool::Helper;
+    helper->driver = new SearchDriver(*this, pool);
+    helper->driver->steps = (i == 0) ? steps : 0;
+    helper->steps = helper->driver->steps;
+    pool->helpers.push_back(helper);
+  }
+}
+
+bool SearchDriver::can_save() const {
+  return workers.empty() && overlay == NULL && pool == NULL;
+}
+
+bool SearchDriver::save(FILE* fp, std::string const& key, int64_t most) {
+  if (!can_save()) return false;
+
+  // Every node takes six bytes at the least, and every crumb two.
+  if (most > 0 && int64_t(nexts.nodes() * 6 + crumbs.size() * 2) > most)
+    return false;
+  const long end = (most > 0) ? ftell(fp) + most : 0;
+  fwrite(CURSOR_MAGIC, 1, sizeof(CURSOR_MAGIC), fp);
+  put_varint(CURSOR_VERSION, fp);
+  put_varint(readers[0]->fingerprint(), fp);
+  put_varint(key.size(), fp);
+  fwrite(key.data(), 1, key.size(), fp);
+  put_double(restart, fp);
+  put_varint(steps, fp);
+
+  // Crumbs by how far back their parents are, which is mostly not far,
+  // times two plus one for a word crumb, which has its scale after it
+  const int num_crumbs = crumbs.size();
+  put_varint(num_crumbs, fp);
+  for (int i = 0; i < num_crumbs; ++i) {
+    Crumb const& crumb = crumbs[i];
+    put_varint(uint64_t(i - crumb.parent) * 2 + crumb.word, fp);
+    putc(crumb.ch, fp);
+    if (crumb.word) put_double(crumbs.scale(i++), fp);
+  }
+
+  if (past(fp, end) || !nexts.save(fp, end)) return false;
+
+  // Texts in order, each as the length it shares with the last and the rest
+  std::vector<const char*> texts = seen.texts();
+  sort(texts.begin(), texts.end(), text_before);
+  put_varint(texts.size(), fp);
+  const char* last = "";
+  for (size_t i = 0; i < texts.size(); ++i) {
+    size_t same = 0;
+    while (last[same] != '\0' && last[same] == texts[i][same]) ++same;
+    const size_t rest = strlen(texts[i] + same);
+    put_varint(same, fp);
+    put_varint(rest, fp);
+    fwrite(texts[i] + same, 1, rest, fp);
+    last = texts[i];
+    if (i % 4096 == 0 && past(fp, end)) return false;
+  }
+  return !past(fp, end);
+}
+
+bool SearchDriver::resume(FILE* fp, std::string const& key) {
+  if (!workers.empty() || overlay != NULL || pool != NULL) {
+    fprintf(stderr, "error: can't resume a search of shards or deltas\n");
+    return false;
+  }
+  assert(steps == 0 && crumbs.size() == 0);
+
+  char magic[sizeof(CURSOR_MAGIC)];
+  uint64_t version, print, size;
+  if (fread(magic, 1, sizeof(magic), fp) != sizeof(magic) ||
+      memcmp(magic, CURSOR_MAGIC, sizeof(magic)) ||
+      !get_varint(fp, &version) || version != CURSOR_VERSION) {
+    fprintf(stderr, "error: not a search cursor\n");
+    return false;
+  }
+
+  if (!get_varint(fp, &print)) return corrupt();
+  if (print != readers[0]->fingerprint()) {
+    fprintf(stderr, "error: search cursor is for another index\n");
+    return false;
+  }
+
+  if (!get_varint(fp, &size) || size > (1 << 20)) return corrupt();
+  std::string saved_key(size, '\0');
+  double saved_restart;
+  if (fread(&saved_key[0], 1, size, fp) != size ||
+      !get_double(fp, &saved_restart))
+    return corrupt();
+  if (saved_key != key || saved_restart != restart) {
+    fprintf(stderr, "error: search cursor is for another search\n");
+    return false;
+  }
+
+  uint64_t saved_steps, num_crumbs;
+  if (!get_varint(fp, &saved_steps) || !get_varint(fp, &num_crumbs) ||
+      num_crumbs > uint64_t(INT_MAX))
+    return corrupt();
+  std::vector<bool> usable;  // The crumbs, but not the scales among them
+  for (uint64_t i = 0; i < num_crumbs; ++i) {
+    uint64_t back;
+    double scale;
+    if (!get_varint(fp, &back) || back < 2 || back / 2 > i + 1)
+      return corrupt();
+    const int ch = getc(fp);
+    if (ch == EOF) return corrupt();
+    Crumb crumb = { int(int64_t(i) - int64_t(back / 2)), char(ch), false, 0 };
+    if (crumb.parent >= 0 && !usable[crumb.parent]) return corrupt();
+    usable.push_back(true);
+    if (!(back & 1)) {
+      crumbs.add(crumb);
+    } else if (++i == num_crumbs || !get_double(fp, &scale) ||
+               !(scale >= 0)) {
+      return corrupt();
+    } else {
+      crumbs.add_word(crumb, scale);
+      usable.push_back(false);
+    }
+  }
+
+  Frontier saved;
+  saved.limit = nexts.limit;
+  if (!saved.load(fp, usable, readers[0]->size(), filter)) return corrupt();
+
+  uint64_t num_texts;
+  if (!get_varint(fp, &num_texts)) return corrupt();
+  std::string text;
+  for (uint64_t i = 0; i < num_texts; ++i) {
+    uint64_t same, rest;
+    if (!get_varint(fp, &same) || !get_varint(fp, &rest) ||
+        same > text.size() || rest > (1 << 20))
+      return corrupt();
+    text.resize(same + rest);
+    if (fread(&text[same], 1, rest, fp) != rest ||
+        memchr(text.data(), '\0', text.size()) != NULL)
+      return corrupt();
+    seen.insert(text.data(), text.size());
+  }
+
+  nexts = std::move(saved);
+  steps = saved_steps;
+  discarded = nexts.discarded();
+  return true;
+}
+
+void SearchDriver::seed(int shard, SearchFilter::State start) {
   Next seed;
-  seed.crumb = -1;
   seed.scale = 1.0;
-  seed.choice.ch = '\0';
-  seed.choice.next = reader->root();
-  seed.choice.count = reader->count();
+  seed.count = shard;
+  seed.ch = '\0';
+  seed.crumb = -1;
   seed.state = start;
-  nexts.push(seed);
+  push(seed, overlay ? overlay->count() : readers[shard]->count());
+}
+
+bool SearchDriver::gather() {
+  // The workers wait for the first step, so the beam can be set first.
+  if (!workers.front()->runner.joinable()) {
+    for (size_t i = 0; i < workers.size(); ++i)
+      workers[i]->runner = thread(&Worker::run, workers[i]);
+  }
+
+  // Each shard's results come best first, so the best of all is the best
+  // of the first from each, once every shard has one (or is done).  Until
+  // then, each wait (for a result, or a few thousand steps more) is a step.
+  int best = -1;
+  double best_score = 0;
+  bool waiting = false;
+  steps = 0;
+  discarded = 0;
+  for (size_t i = 0; i < workers.size(); ++i) {
+    Worker* worker = workers[i];
+    unique_lock<mutex> hold(worker->lock);
+    if (worker->results.empty() && !worker->done && !waiting)
+      worker->changed.wait(hold);
+    steps += worker->steps;
+    discarded += worker->discarded;
+    if (worker->results.empty()) {
+      waiting = waiting || !worker->done;
+    } else if (best < 0 || worker->results.front().first > best_score) {
+      best = i;
+      best_score = worker->results.front().first;
+    }
+  }
+
+  if (waiting) return false;
+  if (best < 0) {
+    text = NULL;
+    score = 0;
+    return true;
+  }
 
-  text = NULL;
-  score = 0;
+  Worker* worker = workers[best];
+  lock_guard<mutex> hold(worker->lock);
+  current = worker->results.front().second;
+  score = worker->results.front().first;
+  text = current.c_str();
+  worker->results.pop_front();
+  worker->changed.notify_all();
+  return true;
 }
 
 bool SearchDriver::step() {
+  if (!workers.empty()) return gather();
+  if (pool != NULL) return collect();
+
+  ++steps;
+  discarded = nexts.discarded();
   if (nexts.empty()) {
     text = NULL;
     score = 0;
     return true;
   }
 
-  const Next next = nexts.top(); nexts.pop();
+  Next next;
+  nexts.pop(&next);
+  return expand(next);
+}
+
+// Adds the children of a node to those to expand, returning true if the
+// node itself is a new result.
+bool SearchDriver::expand(Next const& next) {
+  // The crumb for the children, added with the first of them: at the start
+  // of a word, a word crumb for the space before it (or for nothing, before
+  // the first) with the word's scale.
+  const bool start = next.ch == '\0';
+  Crumb crumb;
+  crumb.parent = next.crumb;
+  crumb.ch = start && next.crumb >= 0 ? ' ' : next.ch;
+  crumb.word = start;
+  crumb.shard = start ? next.count : crumbs[next.crumb].shard;
+  const double scale = start ? next.scale : crumbs.scale(next.crumb);
 
   Next new_next;
-  new_next.crumb = crumbs.size();
-  new_next.scale = next.scale;
-
-  tmp.clear();
-  reader->children(next.choice.next, next.choice.count, CHAR_MIN, CHAR_MAX, &tmp);
-  for (size_t i = 0; i < tmp.size(); ++i) {
-    assert(tmp[i].count > 0);
-    if (filter->has_transition(next.state, tmp[i].ch, &new_next.state)) {
-      if (int(crumbs.size()) == new_next.crumb) {
-        Crumb new_crumb;
-        new_crumb.parent = next.crumb;
-        new_crumb.ch = next.choice.ch;
-        crumbs.push_back(new_crumb);
-      }
-      new_next.choice = tmp[i];
-      nexts.push(new_next);
+  new_next.crumb = -1;  // Until a child needs it
+
+  IndexReader::Node node = next.node;
+  int64_t count = next.count;
+  if (start) {
+    node = overlay ? overlay->root() : readers[crumb.shard]->root();
+    count = overlay ? overlay->count() : readers[crumb.shard]->count();
+  }
+
+  if (overlay != NULL) {
+    IndexReader::Summary summary;
+    choices.clear();
+    if (!overlay->summary(node, count, &summary) ||
+        filter->may_match(next.state, summary)) {
+      overlay->children(node, count, CHAR_MIN, CHAR_MAX, &choices);
     }
+    for (size_t i = 0; i < choices.size(); ++i)
+      add(next, crumb, scale, &new_next, choices[i]);
+  } else {
+    IndexReader::Cursor cursor;
+    readers[crumb.shard]->cursor(node, count, CHAR_MIN, CHAR_MAX, &cursor);
+    bool pruned = cursor.summarized &&
+        !filter->may_match(next.state, cursor.summary);
+    while (!pruned && cursor.next())
+      add(next, crumb, scale, &new_next, cursor.choice);
   }
 
-  if (filter->is_accepting(next.state) && next.crumb != -1) {
+  // (A word's start has the text of the node ending in the space before.)
+  if (filter->is_accepting(next.state) && next.ch != '\0') {
     size_t len = 0;
     for (int i = next.crumb; i >= 0; i = crumbs[i].parent)
       ++len;
 
-    std::string buffer(len--, next.choice.ch);
+    buffer.assign(len--, next.ch);
     for (int i = next.crumb; i >= 0 && len > 0; i = crumbs[i].parent)
       buffer[--len] = crumbs[i].ch;
     assert(len == 0);
 
-    pair<set<string>::iterator, bool> ib = seen.insert(buffer);
-    if (ib.second) {
-      text = ib.first->c_str();
-      score = next.scale * next.choice.count;
-      return true;
+    if (found(next, scale)) return true;
+  }
+
+  go_on(next, scale);
+  return false;
+}
+
+// Starts another word after a node ending in a space, in every shard.
+void SearchDriver::go_on(Next const& next, double scale) {
+  if (restart <= 0.0 || next.ch != ' ') return;
+
+  Next new_next;
+  new_next.scale = scale * next.count / total * restart;
+  new_next.ch = '\0';
+  new_next.crumb = next.crumb;
+  new_next.state = next.state;
+  if (overlay != NULL) {
+    new_next.count = 0;
+    if (overlay->count() > 0)
+      push(new_next, new_next.scale * overlay->count());
+    return;
+  }
+
+  for (size_t i = 0; i < readers.size(); ++i) {
+    if (readers[i]->count() == 0) continue;
+    new_next.count = i;
+    push(new_next, new_next.scale * readers[i]->count());
+  }
+}
+
+// Queues a child of the node being expanded, if the filter takes it.
+void SearchDriver::add(Next const& next, Crumb const& crumb, double scale,
+                       Next* new_next, IndexReader::Choice const& choice) {
+  assert(choice.count > 0);
+  if (!filter->has_transition(next.state, choice.ch, &new_next->state))
+    return;
+
+  if (new_next->crumb < 0) {
+    new_next->crumb =
+        crumb.word ? crumbs.add_word(crumb, scale) : crumbs.add(crumb);
+  }
+  new_next->node = choice.next;
+  new_next->count = choice.count;
+  new_next->ch = choice.ch;
+  push(*new_next, scale * choice.count);
+}
+
+void SearchDriver::push(Next next, double score) {
+  next.key = Frontier::key(score);
+  if (pool != NULL)
+    pending.push_back(next);  // For Pool::run to add
+  else
+    nexts.push(next);
+}
+
+// Takes the text in buffer, found at this node, as a result, unless it was
+// one already.
+bool SearchDriver::found(Next const& next, double scale) {
+  if (pool == NULL) {
+    const char* added = seen.insert(buffer.data(), buffer.size());
+    if (added == NULL) return false;
+    text = added;
+    score = scale * next.count;
+    return true;
+  }
+
+  unique_lock<mutex> hold(pool->lock);
+  Pool::Seen::iterator it = pool->seen.find(buffer);
+  if (it == pool->seen.end()) {
+    Pool::Found found = { next, false };
+    it = pool->seen.insert(make_pair(buffer, found)).first;
+  } else if (it->second.out || !(it->second.next < next)) {
+    return false;
+  } else {
+    // Searching in order, this node would have come first, and the other
+    // would have gone on to the next word; so swap them.
+    Next other = it->second.next;
+    it->second.next = next;
+    pool->results.push(make_pair(scale * next.count, &*it));
+    hold.unlock();
+    go_on(other, crumbs.scale(other.crumb));
+    return true;
+  }
+
+  pool->results.push(make_pair(scale * next.count, &*it));
+  return true;
+}
+
+// Hands out the pool's best result once nothing left can beat it (by more
+// than the slack), checking again every millisecond or so while it waits.
+bool SearchDriver::collect() {
+  // The helpers wait for the first step, so the beam can be set first.
+  if (!pool->helpers.front()->runner.joinable()) {
+    for (size_t i = 0; i < pool->helpers.size(); ++i)
+      pool->helpers[i]->runner = thread(&Pool::run, pool, pool->helpers[i]);
+  }
+
+  unique_lock<mutex> hold(pool->lock);
+  if (!pool->ready() && pool->bound >= 0) {
+    hold.unlock();
+    pool->check(&steps, &discarded);
+    discarded += nexts.discarded();  // From before the pool (see resume())
+    hold.lock();
+    if (!pool->ready() && pool->bound >= 0) {
+      hold.unlock();
+      this_thread::sleep_for(chrono::milliseconds(1));
+      return false;
     }
   }
 
-  if (restart > 0.0 &&
-      next.choice.ch == ' ' &&
-      next.choice.next != reader->root()) {
-    new_next.crumb = next.crumb;
-    new_next.scale = next.scale * next.choice.count / reader->count() * restart;
-    new_next.choice.ch = next.choice.ch;
-    new_next.choice.count = reader->count();
-    new_next.choice.next = reader->root();
-    new_next.state = next.state;
-    nexts.push(new_next);
+  if (pool->results.empty()) {
+    text = NULL;
+    score = 0;
+    return true;
   }
 
-  return false;
+  pair<double, Pool::Seen::value_type*> result = pool->results.top();
+  pool->results.pop();
+  if (result.second->second.out) return false;  // Passed over for a better
+  result.second->second.out = true;
+  score = result.first;
+  text = result.second->first.c_str();
+  return true;
+}
+
+// The top bits of a positive double (as of any float in IEEE format) order
+// it as its value does: the exponent first, then the leading bits of the
+// fraction.  A key is the 38 below the sign bit (to within a part in 10^8 or
+// so), then the low bits of the seq, inverted so that the lower comes first
+// (they wrap, but only for ties pushed tens of millions apart).  Buckets go
+// by the exponent and two bits.
+static const int SEQ_BITS = 26;
+static const uint64_t SEQ_MASK = (uint64_t(1) << SEQ_BITS) - 1;
+static const int BUCKETS = 1 << 13;
+
+SearchDriver::Frontier::Frontier():
+    limit(0), buckets(BUCKETS, NULL), used(BUCKETS / 64, 0), minmax(false),
+    top_bucket(BUCKETS), size(0), pushed(0), dropped(0) {}
+
+SearchDriver::Frontier::~Frontier() {
+  for (int b = 0; b < BUCKETS; ++b) delete buckets[b];
+}
+
+SearchDriver::Frontier& SearchDriver::Frontier::operator=(Frontier&& from) {
+  std::swap(limit, from.limit);
+  buckets.swap(from.buckets);
+  used.swap(from.used);
+  heap.swap(from.heap);
+  std::swap(minmax, from.minmax);
+  std::swap(top_bucket, from.top_bucket);
+  std::swap(size, from.size);
+  std::swap(pushed, from.pushed);
+  std::swap(dropped, from.dropped);
+  return *this;
+}
+
+uint64_t SearchDriver::Frontier::key(double score) {
+  uint64_t bits;
+  memcpy(&bits, &score, sizeof(bits));
+  return (bits << 1) & ~SEQ_MASK;  // Past the sign bit, which is always clear
+}
+
+int SearchDriver::Frontier::bucket(uint64_t key) {
+  return key >> (64 - 13);
+}
+
+// The most a node with this key can score
+double SearchDriver::Frontier::score(uint64_t key) {
+  const uint64_t bits = (key | SEQ_MASK) >> 1;
+  double score;
+  memcpy(&score, &bits, sizeof(score));
+  return score;
+}
+
+int SearchDriver::Frontier::highest() const {
+  for (size_t w = used.size(); w-- > 0; )
+    if (used[w] != 0) return w * 64 + 63 - __builtin_clzll(used[w]);
+  return -1;
+}
+
+int SearchDriver::Frontier::lowest() const {
+  for (size_t w = 0; w < used.size(); ++w)
+    if (used[w] != 0) return w * 64 + __builtin_ctzll(used[w]);
+  return -1;
+}
+
+void SearchDriver::Frontier::push(Next const& in) {
+  Next next = in;
+  next.key |= ~pushed++ & SEQ_MASK;
+  if (limit > 0 && size >= limit) {
+    // Full, so drop the least, this one or the least in the lowest bucket
+    // (or in the heap, if every node is there).
+    const int low = lowest();
+    if (low >= 0) {
+      std::deque<Next>* from = buckets[low];
+      if (!(from->front() < next)) {
+        dropped += score(next.key);
+        return;
+      }
+      dropped += score(from->front().key);
+      pop_heap(from->begin(), from->end(), least_first);
+      from->pop_back();
+      if (from->empty()) release(low);
+    } else {
+      if (!minmax) {
+        minmax = true;
+        for (size_t i = heap.size() / 2; i-- > 0; ) trickle_down(i);
+      }
+      if (!(heap[0] < next)) {
+        dropped += score(next.key);
+        return;
+      }
+      dropped += score(heap[0].key);
+      heap_remove(0);
+    }
+    --size;
+  }
+
+  ++size;
+  const int b = bucket(next.key);
+  if (b >= top_bucket) {
+    heap_push(next);
+  } else {
+    if (buckets[b] == NULL) {
+      buckets[b] = new std::deque<Next>;
+      used[b / 64] |= uint64_t(1) << (b % 64);
+    }
+    buckets[b]->push_back(next);
+    push_heap(buckets[b]->begin(), buckets[b]->end(), least_first);
+  }
+}
+
+// Takes the next bucket down into the heap (nothing above it is left).
+void SearchDriver::Frontier::refill() {
+  top_bucket = highest();
+  std::deque<Next> const* from = buckets[top_bucket];
+  heap.assign(from->begin(), from->end());
+  if (minmax) {
+    for (size_t i = heap.size() / 2; i-- > 0; ) trickle_down(i);
+  } else {
+    make_heap(heap.begin(), heap.end());
+  }
+  release(top_bucket);
+}
+
+void SearchDriver::Frontier::release(int b) {
+  delete buckets[b];
+  buckets[b] = NULL;
+  used[b / 64] &= ~(uint64_t(1) << (b % 64));
+}
+
+double SearchDriver::Frontier::best() {
+  if (size == 0) return -1;
+  if (heap.empty()) refill();
+  return score(heap[top()].key);
+}
+
+void SearchDriver::Frontier::pop(Next* next) {
+  assert(size > 0);
+  if (heap.empty()) refill();
+  const size_t i = top();
+  *next = heap[i];
+  heap_remove(i);
+  --size;
+}
+
+// In a min-max heap, the least is at the root (on a min level, as every
+// other level is), and the most is one of its children.
+static bool min_level(size_t i) {
+  int level = 0;
+  for (++i; i > 1; i >>= 1) ++level;
+  return level % 2 == 0;
+}
+
+size_t SearchDriver::Frontier::top() const {
+  if (!minmax || heap.size() == 1) return 0;
+  if (heap.size() == 2) return 1;
+  return heap[1] < heap[2] ? 2 : 1;
+}
+
+void SearchDriver::Frontier::heap_push(Next const& next) {
+  heap.push_back(next);
+  if (!minmax) {
+    push_heap(heap.begin(), heap.end());
+    return;
+  }
+
+  const size_t i = heap.size() - 1;
+  if (i == 0) return;
+  const size_t parent = (i - 1) / 2;
+  const bool max = !min_level(i);
+  if (above(!max, heap[i], heap[parent])) {
+    swap(heap[i], heap[parent]);
+    bubble_up(parent, !max);
+  } else {
+    bubble_up(i, max);
+  }
+}
+
+// Removes the best, or in a min-max heap the least (at the root).
+void SearchDriver::Frontier::heap_remove(size_t i) {
+  if (!minmax) {
+    assert(i == 0);
+    pop_heap(heap.begin(), heap.end());
+    heap.pop_back();
+    return;
+  }
+
+  heap[i] = heap.back();
+  heap.pop_back();
+  if (i < heap.size()) trickle_down(i);
+}
+
+// Moves heap[i] down past any of its children and grandchildren that
+// belong above it on its level.
+void SearchDriver::Frontier::trickle_down(size_t i) {
+  const bool max = !min_level(i);
+  for (;;) {
+    const size_t child = 2 * i + 1, grandchild = 2 * child + 1;
+    if (child >= heap.size()) return;
+
+    size_t m = child;
+    if (child + 1 < heap.size() && above(max, heap[child + 1], heap[m]))
+      m = child + 1;
+    for (size_t c = grandchild; c < grandchild + 4 && c < heap.size(); ++c)
+      if (above(max, heap[c], heap[m])) m = c;
+
+    if (!above(max, heap[m], heap[i])) return;
+    swap(heap[m], heap[i]);
+    if (m < grandchild) return;
+
+    // What came down may belong on the level between.
+    const size_t parent = (m - 1) / 2;
+    if (above(max, heap[parent], heap[m])) swap(heap[parent], heap[m]);
+    i = m;
+  }
+}
+
+// Moves heap[i] up past grandparents that it belongs above.
+void SearchDriver::Frontier::bubble_up(size_t i, bool max) {
+  while (i >= 3) {
+    const size_t grandparent = ((i - 1) / 2 - 1) / 2;
+    if (!above(max, heap[i], heap[grandparent])) return;
+    swap(heap[i], heap[grandparent]);
+    i = grandparent;
+  }
+}
+
+void SearchDriver::Frontier::put(Next const& next, FILE* fp) {
+  put_varint(next.key, fp);
+  putc(next.ch, fp);
+  if (next.ch == '\0')
+    put_double(next.scale, fp);
+  else
+    put_varint(next.node + 1, fp);
+  put_varint(next.count, fp);
+  put_varint(next.crumb + 1, fp);
+  put_varint(uint32_t(next.state), fp);
+}
+
+static bool valid_crumb(int crumb, std::vector<bool> const& crumbs) {
+  return crumb < int(crumbs.size()) && (crumb < 0 || crumbs[crumb]);
+}
+
+// (At the start of a word, only in shard 0: cursors are for one index.
+// Elsewhere, a node always has a crumb and a count, and is -1 or at an
+// offset in the index, 1 to nodes.)
+bool SearchDriver::Frontier::get(FILE* fp, ssize_t nodes, Next* next) {
+  uint64_t node, count, crumb, state;
+  if (!get_varint(fp, &next->key)) return false;
+  const int ch = getc(fp);
+  if (ch == EOF) return false;
+  if (ch == '\0') {
+    if (!get_double(fp, &next->scale) || !(next->scale >= 0)) return false;
+  } else if (get_varint(fp, &node) && node <= uint64_t(nodes) + 1 &&
+             node != 1) {
+    next->node = IndexReader::Node(node) - 1;
+  } else {
+    return false;
+  }
+  if (!get_varint(fp, &count) || !get_varint(fp, &crumb) ||
+      !get_varint(fp, &state))
+    return false;
+  if (count >= (uint64_t(1) << 55) || crumb > uint64_t(INT_MAX) ||
+      (ch == '\0' ? count != 0 : crumb == 0 || count == 0) ||
+      state > UINT32_MAX)
+    return false;
+  next->count = count;
+  next->ch = ch;
+  next->crumb = int(crumb) - 1;  // At least -1
+  next->state = SearchFilter::State(uint32_t(state));
+  return true;
+}
+
+// Everything but the limit (set_beam's business).  Keys don't repeat (bar
+// ties pushed 2^26 apart), so the order in the heap and buckets is no
+// matter: a search goes on exactly as it would have, with load() making
+// the heaps afresh.  Returns false if it goes past end.
+bool SearchDriver::Frontier::save(FILE* fp, long end) const {
+  put_double(dropped, fp);
+  put_varint(pushed, fp);
+  put_varint(top_bucket, fp);
+  put_varint(heap.size(), fp);
+  for (size_t i = 0; i < heap.size(); ++i) put(heap[i], fp);
+  if (past(fp, end)) return false;
+  for (int b = lowest(); b >= 0 && b < top_bucket; ++b) {
+    if (buckets[b] == NULL) continue;
+    put_varint(b + 1, fp);
+    put_varint(buckets[b]->size(), fp);
+    for (size_t i = 0; i < buckets[b]->size(); ++i) put((*buckets[b])[i], fp);
+    if (past(fp, end)) return false;
+  }
+  put_varint(0, fp);
+  return true;
+}
+
+// (Into an empty frontier; the limit only applies to nodes added later.)
+bool SearchDriver::Frontier::load(FILE* fp, std::vector<bool> const& crumbs,
+                                  ssize_t nodes, const SearchFilter* filter) {
+  uint64_t top, count, b;
+  if (!get_double(fp, &dropped) || !get_varint(fp, &pushed) ||
+      !get_varint(fp, &top) || top > BUCKETS || !get_varint(fp, &count))
+    return false;
+  top_bucket = top;
+  for (; count > 0; --count) {
+    Next next;
+    if (!get(fp, nodes, &next) || !valid_crumb(next.crumb, crumbs) ||
+        !filter->is_state(next.state))
+      return false;
+    heap.push_back(next);
+    ++size;
+  }
+  make_heap(heap.begin(), heap.end());
+
+  // Then each bucket below that, by number plus one, ending with zero
+  for (uint64_t last = 0;; last = b + 1) {
+    if (!get_varint(fp, &b)) return false;
+    if (b-- == 0) return true;
+    if (b < last || b >= top || !get_varint(fp, &count) || count == 0)
+      return false;
+    buckets[b] = new std::deque<Next>;
+    used[b / 64] |= uint64_t(1) << (b % 64);
+    for (; count > 0; --count) {
+      Next next;
+      if (!get(fp, nodes, &next) || !valid_crumb(next.crumb, crumbs) ||
+          !filter->is_state(next.state))
+        return false;
+      buckets[b]->push_back(next);
+      ++size;
+    }
+    make_heap(buckets[b]->begin(), buckets[b]->end(), least_first);
+  }
 }
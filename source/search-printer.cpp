@@ -1,21 +1,165 @@
 #include "index.h"
 #include "search.h"
 
+#include <inttypes.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <string>
 
 void PrintAll(SearchDriver* d) {
-  int count = 0;
-  for (;;) {
-    if (!(++count % 100000)) {
-      printf("# %d\n", count);
-      fflush(stdout);
-    }
+  PrintSome(d, -1);
+}
+
+// Reports progress every 100000 steps (a sharded search takes many at once).
+static void Report(SearchDriver* d, int64_t* report) {
+  for (; d->steps + 1 >= *report; *report += 100000) {
+    printf("# %" PRId64 "\n", *report);
+    fflush(stdout);
+  }
+}
+
+bool PrintSome(SearchDriver* d, int64_t count) {
+  // (a resumed search starts with steps already taken)
+  int64_t report = (d->steps / 100000 + 1) * 100000;
+  for (int64_t printed = 0; count < 0 || printed < count;) {
+    Report(d, &report);
     if (d->step()) {
-      if (d->text == NULL) break;
+      if (d->text == NULL) {
+        if (d->discarded > 0) printf("# discarded %.8g\n", d->discarded);
+        return false;
+      }
       int len = strlen(d->text);
       while (len > 0 && d->text[len - 1] == ' ') --len;
       printf("%.8g %.*s\n", d->score, len, d->text);
+      ++printed;
+    }
+  }
+
+  fflush(stdout);
+  return true;
+}
+
+// Steps on to the next result without printing it; false if there is none.
+static bool FindMore(SearchDriver* d) {
+  int64_t report = (d->steps / 100000 + 1) * 100000;
+  for (;;) {
+    Report(d, &report);
+    if (d->step()) return d->text != NULL;
+  }
+}
+
+bool ResumeSearch(SearchDriver* d, const char* filename,
+                  std::string const& key) {
+  FILE* fp = fopen(filename, "rb");
+  if (fp == NULL) {
+    fprintf(stderr, "error: can't read \"%s\"\n", filename);
+    return false;
+  }
+
+  const bool resumed = d->resume(fp, key);
+  fclose(fp);
+  return resumed;
+}
+
+bool SaveSearch(SearchDriver* d, const char* filename,
+                std::string const& key, int64_t most) {
+  if (!d->can_save()) {
+    fprintf(stderr, "error: can't save a search of shards or deltas, or on "
+        "several threads\n");
+    return false;
+  }
+
+  // Written beside the cursor under a name of its own, so that searches
+  // saving the same cursor at once each put a whole one in place.
+  std::string temp = std::string(filename) + ".XXXXXX";
+  const int fd = mkstemp(&temp[0]);
+  FILE* fp = (fd < 0) ? NULL : fdopen(fd, "wb");
+  if (fp == NULL) {
+    if (fd >= 0) {
+      close(fd);
+      remove(temp.c_str());
+    }
+    fprintf(stderr, "error: can't write \"%s\"\n", temp.c_str());
+    return false;
+  }
+
+  // (mkstemp makes a file only its owner can read; a cursor is like any other.)
+  const mode_t mask = umask(0);
+  umask(mask);
+  fchmod(fd, 0666 & ~mask);
+
+  if (!d->save(fp, key, most)) {  // Too big to be worth keeping
+    fclose(fp);
+    remove(temp.c_str());
+    return true;
+  }
+
+  const bool failed = ferror(fp);
+  if (fclose(fp) != 0 || failed) {
+    remove(temp.c_str());
+    fprintf(stderr, "error: can't write \"%s\"\n", temp.c_str());
+    return false;
+  }
+
+  // If another search put its cursor in place instead, that one will do.
+  if (rename(temp.c_str(), filename) != 0) {
+    remove(temp.c_str());
+    if (access(filename, F_OK) != 0) {
+      fprintf(stderr, "error: can't write \"%s\"\n", filename);
+      return false;
+    }
+  }
+  return true;
+}
+
+bool SearchOptions::parse(int argc, char* argv[]) {
+  int opt;
+  while ((opt = getopt(argc, argv, "b:n:r:s:t:w:W:")) != -1) {
+    switch (opt) {
+      case 'b':
+        if (atoll(optarg) < 0) return false;
+        beam = atoll(optarg);
+        break;
+      case 'n': count = atoll(optarg); break;
+      case 'r': resume_from = optarg; break;
+      case 's': slack = atof(optarg); break;
+      case 't': threads = atoi(optarg); break;
+      case 'w': save_to = optarg; break;
+      case 'W':
+        cursor_bytes = atoll(optarg);
+        if (cursor_bytes < 0) return false;
+        break;
+      default: return false;
     }
   }
+
+  return threads >= 1 && slack >= 0 &&
+      (save_to == NULL || (count >= 0 && threads == 1)) &&
+      (save_to != NULL || cursor_bytes == 0);
+}
+
+int RunSearch(SearchOptions const& options, const char* index_name,
+              const SearchFilter* filter, SearchFilter::State start,
+              std::string const& key) {
+  IndexReader::Options reader;
+  if (!reader.parse_environment()) return 2;
+
+  IndexShards index(index_name, reader);
+  SearchDriver driver(index, filter, start, 1e-6);
+  driver.set_beam(options.beam);
+  if (options.resume_from != NULL &&
+      !ResumeSearch(&driver, options.resume_from, key))
+    return 1;
+  driver.set_threads(options.threads, options.slack);
+  if (!PrintSome(&driver, options.count) || options.save_to == NULL) return 0;
+  if (!SaveSearch(&driver, options.save_to, key, options.cursor_bytes))
+    return 1;
+
+  // With the cursor saved, whether it has anything left to find
+  if (FindMore(&driver)) printf("# more\n");
+  return 0;
 }
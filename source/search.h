@@ -1,6 +1,8 @@
+#include <stdint.h>
+#include <stdio.h>
+
+#include <atomic>
 #include <deque>
-#include <queue>
-#include <set>
 #include <string>
 #include <vector>
 
@@ -8,45 +10,306 @@ struct SearchFilter {
   typedef int State;
   virtual bool is_accepting(State state) const = 0;
   virtual bool has_transition(State from, char ch, State* to) const = 0;
+  virtual bool is_state(State state) const = 0;  // For checking cursors
+
+  // False if no path through a subtree with this summary can take the state
+  // to acceptance or to a space; by default the filter never rules one out.
+  virtual bool may_match(State state, IndexReader::Summary const&) const {
+    return true;
+  }
+
   virtual ~SearchFilter() { }
 };
 
+// A set of texts that hands out pointers to its own copies, which stay put
+// for as long as the set does: the texts are packed end to end in large
+// blocks, and found again through an open-addressed table of their hashes.
+class TextSet {
+ public:
+  TextSet();
+  ~TextSet();
+
+  // Adds the len bytes at text (which has no '\0' among them), returning
+  // the copy, or NULL if the set already had it.
+  const char* insert(const char* text, size_t len);
+  size_t size() const { return count; }
+  std::vector<const char*> texts() const;  // In no particular order
+
+ private:
+  struct Slot {
+    uint64_t hash;
+    const char* text;  // NULL if empty
+  };
+
+  std::vector<Slot> slots;  // A power of two in size, at most half full.
+  size_t count;
+  std::vector<char*> blocks;
+  char* space;  // Free space at the end of the last block
+  size_t space_left;
+
+  char* allocate(size_t size);
+  void grow();
+};
+
 class SearchDriver {
  public:
   const char* text;
   double score;
+  int64_t steps;  // Nodes expanded so far.
+  double discarded;  // Total score of the nodes dropped by the beam.
 
   SearchDriver(const IndexReader*,
                const SearchFilter*,
                SearchFilter::State start,
                double restart);
 
+  // Searches the shards of an index (see IndexShards) together, each in its
+  // own thread, merging their results by score.  Restarts after a space go
+  // to every shard, so the results are as for the unsplit index.
+  SearchDriver(std::vector<const IndexReader*> const& shards,
+               const SearchFilter*,
+               SearchFilter::State start,
+               double restart);
+
+  // Searches an index as opened by IndexShards: its shards as above, or if
+  // it has deltas, all of them together through its IndexOverlay (in this
+  // thread).
+  SearchDriver(IndexShards const& index,
+               const SearchFilter*,
+               SearchFilter::State start,
+               double restart);
+  ~SearchDriver();
+
+  // Keeps at most this many nodes waiting to be expanded, dropping the
+  // lowest-scoring to make room and adding their scores to discarded.  With
+  // shards or threads the limit is split evenly between their frontiers,
+  // each dropping its own lowest, which is only roughly the lowest of all.
+  // Until the limit is reached the search is exactly as without one.  Call
+  // before the first step.
+  void set_beam(size_t entries);
+
+  // Expands nodes on this many threads at once, each taking one of the
+  // best few left rather than strictly the best.  A result is handed out
+  // once no node left could score more than (1 + slack) times as much, so
+  // with no slack the results are as usual (ties may come in another
+  // order).  Only for one unsharded index without deltas (sharded searches
+  // have a thread per shard already); call before the first step.
+  void set_threads(int threads, double slack);
+
+  // Writes a cursor: where the search is up to (the nodes left to expand,
+  // the results so far and so on), in a form resume() can read back in a
+  // later driver searching the same index with the same filter.  The key
+  // (the query, say) must match too.  Only for one index without deltas,
+  // searched on one thread; returns false (writing nothing) for others.
+  // With most, also returns false once the cursor would pass that many
+  // bytes, having written part of it (or none, if it surely would).
+  bool can_save() const;
+  bool save(FILE*, std::string const& key, int64_t most = 0);
+
+  // Goes on from a cursor written by save(), in place of the search so far,
+  // returning false (and printing why) if it isn't one for this index and
+  // key.  Call before the first step, and before set_threads.
+  bool resume(FILE*, std::string const& key);
+
   bool step();
   void next() { while (!step()) ; }
 
  private:
+  friend struct SearchTest;  // test-search tries out the frontier directly
+
+  // A node waiting to be expanded, kept small as there can be tens of
+  // millions of them.  Its key orders it: by the top bits of its score (its
+  // count times the scale of the word it's in; see Crumbs::scale), then by
+  // when it was pushed, so that of equal scores the first out was first in.
+  // At the start of a word, it's the root of a shard, so rather than the
+  // node and count it has the word's scale and the shard.
   struct Next {
-    int crumb;
-    double scale;
-    IndexReader::Choice choice;
+    uint64_t key;  // See Frontier::key
+    union {
+      IndexReader::Node node;  // Indexes run to many gigabytes
+      double scale;
+    };
+    int64_t count : 56;
+    char ch;  // '\0' at the start of a word
+    int crumb;  // The text before it, if any
     SearchFilter::State state;
-    bool operator<(Next const& n) const {
-      return choice.count * scale < n.choice.count * n.scale;
+    bool operator<(Next const& n) const { return key < n.key; }
+  };
+
+  // The nodes to expand, best first.  They are kept in buckets by the top
+  // bits of their keys (their scores' binary exponents and top two bits,
+  // four to a doubling), taking one bucket at a time into a heap.  As
+  // children never score higher than their parents, the nodes added mostly
+  // go straight into a lower bucket, and the heap stays small.
+  //
+  // With a limit, the node dropped to make room is always the least of all
+  // (or the one being added, if that's less).  So each bucket is a heap
+  // with its least on top, and the heap turns into a min-max heap the first
+  // time the least is in it, as happens once every node is.
+  class Frontier {
+   public:
+    Frontier();
+    ~Frontier();
+    Frontier& operator=(Frontier&& from);  // Swaps, for from to delete these
+    size_t limit;  // Zero for no limit
+    static uint64_t key(double score);  // Less the seq, which push adds
+    bool empty() const { return size == 0; }
+    size_t nodes() const { return size; }
+    void push(Next const& next);  // With its key from key()
+    void pop(Next* next);
+    double best();  // At least the score of the next to pop; -1 if empty
+    double discarded() const { return dropped; }
+    bool save(FILE*, long end) const;  // See SearchDriver::save
+    // Each node's crumb must be -1 or one that's true in crumbs, its index
+    // node -1 or within the first nodes bytes, and its state the filter's.
+    bool load(FILE*, std::vector<bool> const& crumbs, ssize_t nodes,
+              const SearchFilter* filter);
+
+   private:
+    // Each made when first needed and freed when emptied (NULL in between),
+    // so that an idle frontier is small; grown without slack.
+    std::vector<std::deque<Next>*> buckets;
+    std::vector<uint64_t> used;  // The buckets made, a bit each
+    std::vector<Next> heap;  // Every node in top_bucket or above
+    bool minmax;  // If heap has become a min-max heap
+    int top_bucket;
+    size_t size;
+    uint64_t pushed;  // The next seq
+    double dropped;
+
+    static int bucket(uint64_t key);
+    static double score(uint64_t key);
+    int highest() const;
+    int lowest() const;
+    void refill();
+    void release(int b);
+    size_t top() const;  // Where the best in the heap is
+    void heap_push(Next const& next);
+    void heap_remove(size_t i);
+    void trickle_down(size_t i);
+    void bubble_up(size_t i, bool max);
+    static void put(Next const& next, FILE*);
+    static bool get(FILE*, ssize_t nodes, Next* next);
+
+    // True if a belongs nearer the top of a max (or min) level than b.
+    static bool above(bool max, Next const& a, Next const& b) {
+      return max ? b < a : a < b;
     }
+
+    // Orders a bucket as a heap with the least on top.
+    static bool least_first(Next const& a, Next const& b) { return b < a; }
   };
 
+  // The text leading to a node that was expanded, and the shard it's in.
+  // A word crumb, for the children of the start of a word, has the scale
+  // for every node in the word.
   struct Crumb {
     int parent;
     char ch;
+    bool word;
+    short shard;
+  };
+
+  // The crumbs, in blocks that never move (1024 crumbs, then each block
+  // twice the last), so that threads can add to them while others read.
+  class Crumbs {
+   public:
+    Crumbs();
+    ~Crumbs();
+    int add(Crumb const& crumb);  // Returns its number
+    int add_word(Crumb const& crumb, double scale);  // Takes two numbers
+    int size() const { return count; }
+    double scale(int i) const;  // Of the nodes with crumb i
+    Crumb const& operator[](int i) const {
+      const int b = block(i);
+      Crumb const* in = blocks[b].load(std::memory_order_acquire);
+      return in[i + FIRST - (FIRST << b)];
+    }
+
+   private:
+    static const int FIRST = 1024;
+    std::atomic<int> count;
+    std::atomic<Crumb*> blocks[32];
+    static int block(int i) { return 21 - __builtin_clz(unsigned(i) + FIRST); }
+    Crumb* slot(int i);
   };
 
-  std::priority_queue<Next> nexts;
-  std::deque<Crumb> crumbs;
-  std::vector<IndexReader::Choice> tmp;
-  std::set<std::string> seen;
-  const IndexReader* const reader;
+  Frontier nexts;
+  Crumbs local_crumbs;
+  Crumbs& crumbs;  // local_crumbs, or those of the driver sharing its pool
+  TextSet seen;
+  std::string buffer;
+  std::vector<const IndexReader*> readers;
+  const IndexOverlay* overlay;  // Used instead of the readers, if set.
+  std::vector<IndexReader::Choice> choices;
+  int64_t total;
   const SearchFilter* const filter;
   const double restart;
+
+  // With several shards, a driver per shard, each run by its own thread.
+  struct Worker;
+  std::vector<Worker*> workers;
+  std::string current;
+  SearchDriver(std::vector<const IndexReader*> const& shards, int seed,
+               const SearchFilter*, SearchFilter::State start, double restart);
+  void start_shards(SearchFilter::State start);
+  void seed(int shard, SearchFilter::State start);
+  bool expand(Next const& next);
+  void add(Next const& next, Crumb const& crumb, double scale,
+           Next* new_next, IndexReader::Choice const& choice);
+  void push(Next next, double score);
+  bool found(Next const& next, double scale);
+  void go_on(Next const& next, double scale);
+  bool gather();
+
+  // With set_threads, the nodes and results shared by every thread, each
+  // with a driver of its own (sharing this one's crumbs) to expand nodes.
+  struct Pool;
+  Pool* pool;
+  std::vector<Next> pending;  // Children to add to the pool together
+  uint64_t random;  // For choosing among the pool's queues
+  SearchDriver(SearchDriver& main, Pool* pool);
+  bool collect();
 };
 
 void PrintAll(SearchDriver*);
+
+// As PrintAll, but stops after count results (unless count is negative),
+// returning false if the search has no more.
+bool PrintSome(SearchDriver*, int64_t count);
+
+// Cursor files for the search tools (see SearchDriver::save); these print
+// any error and return false.  A cursor is written under a temporary name
+// of its own, then put in place of any old one all at once, so a search
+// resuming from it never sees half of one (or a mix of two).
+bool ResumeSearch(SearchDriver*, const char* filename, std::string const& key);
+// A cursor that would pass most bytes (unless most is zero) is not written,
+// and the search is taken as saved: the next one starts over.
+bool SaveSearch(SearchDriver*, const char* filename, std::string const& key,
+                int64_t most = 0);
+
+// The options the search tools share: [-b beam] [-t threads] [-s slack]
+// [-r cursor] [-n count [-w cursor [-W bytes]]].
+struct SearchOptions {
+  size_t beam;  // Zero for no limit
+  int threads;
+  double slack;
+  int64_t count;  // Negative for every result
+  const char *resume_from, *save_to;
+  int64_t cursor_bytes;  // Most to save; zero for no limit
+
+  SearchOptions(): beam(0), threads(1), slack(0), count(-1),
+                   resume_from(NULL), save_to(NULL), cursor_bytes(0) { }
+
+  // Takes the options (by getopt, so optind is left at the first argument
+  // after them), returning false for any that are bad together or alone.
+  bool parse(int argc, char* argv[]);
+};
+
+// Searches an index (with the reader options from $NUTRIMATIC_READER) as the
+// options say, printing results; key is for the cursors.  Having saved one,
+// goes on to the next result, printing "# more" if there is one.  Returns
+// the exit status for the tool, having printed any error.
+int RunSearch(SearchOptions const&, const char* index_name,
+              const SearchFilter* filter, SearchFilter::State start,
+              std::string const& key);
@@ -0,0 +1,693 @@
+#include "index.h"
+
+#include <algorithm>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <inttypes.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+typedef std::vector<std::pair<std::string, int64_t> > Entries;
+
+static void CheckIndex(const char *name, Entries const& entries, off_t span,
+                       IndexReader const& reader) {
+  int64_t total = 0;
+  for (size_t i = 0; i < entries.size(); ++i) total += entries[i].second;
+  if (reader.version() != 1 || !reader.scale().empty() ||
+      reader.count() != total) {
+    fprintf(stderr, "FAIL: %s: version %d, total %" PRId64
+        " (expected %" PRId64 ")\n", name, reader.version(),
+        reader.count(), total);
+    exit(1);
+  }
+
+  IndexWalker walker(&reader, reader.root(), reader.count());
+  for (size_t i = 0; i < entries.size(); ++i, walker.next()) {
+    if (walker.text == NULL || entries[i].first != walker.text ||
+        entries[i].second != walker.count) {
+      fprintf(stderr, "FAIL: %s: [%s] * %" PRId64 " (expected [%s] * %"
+          PRId64 ")\n", name, walker.text ? walker.text : "NULL",
+          walker.count, entries[i].first.c_str(), entries[i].second);
+      exit(1);
+    }
+  }
+
+  if (walker.text != NULL) {
+    fprintf(stderr, "FAIL: %s: [%s] (extra)\n", name, walker.text);
+    exit(1);
+  }
+
+  // Check the root summary
+
+  IndexReader::Summary expect = { 0xFF, 0, 0 };
+  for (size_t i = 0; i < entries.size(); ++i) {
+    size_t len = entries[i].first.find(' ');
+    if (len != std::string::npos) expect.min = std::min<int>(expect.min, len);
+    len = std::min(len, entries[i].first.size());
+    expect.max = std::max<int>(expect.max, len);
+    for (size_t j = 0; j < len; ++j) {
+      int bit = IndexReader::letter_bit(entries[i].first[j]);
+      expect.letters |= (bit < 0) ? ~uint64_t(0) : uint64_t(1) << bit;
+    }
+  }
+
+  IndexReader::Cursor cursor;
+  reader.cursor(reader.root(), reader.count(), CHAR_MIN, CHAR_MAX, &cursor);
+  if (span > 0 && !entries.empty() &&
+      (!cursor.summarized || cursor.summary.min != expect.min ||
+       cursor.summary.max != expect.max ||
+       cursor.summary.letters != expect.letters)) {
+    fprintf(stderr, "FAIL: %s: root summary %d %d %" PRIx64 " (expected %d %d %"
+        PRIx64 ")\n", name, cursor.summary.min, cursor.summary.max,
+        cursor.summary.letters, expect.min, expect.max, expect.letters);
+    exit(1);
+  }
+
+  // Look up each letter and letter range below the root
+
+  std::vector<IndexReader::Choice> all, some;
+  reader.children(reader.root(), reader.count(), CHAR_MIN, CHAR_MAX, &all);
+  for (size_t i = 0; i < all.size(); ++i) {
+    for (size_t j = i; j < all.size(); ++j) {
+      some.clear();
+      reader.children(reader.root(), reader.count(),
+                      all[i].ch, all[j].ch, &some);
+      if (some.size() != j - i + 1 || some[0].ch != all[i].ch ||
+          some[0].count != all[i].count || some[0].next != all[i].next) {
+        fprintf(stderr, "FAIL: %s: [%c-%c] -> %zu choices\n",
+            name, all[i].ch, all[j].ch, some.size());
+        exit(1);
+      }
+    }
+
+    some.clear();
+    reader.children(reader.root(), reader.count(),
+                    all[i].ch + 1, all[i].ch + 1, &some);
+    if (!some.empty() && (i + 1 == all.size() || some[0].ch != all[i + 1].ch)) {
+      fprintf(stderr, "FAIL: %s: [%c] -> '%c'\n", name, all[i].ch + 1,
+          some[0].ch);
+      exit(1);
+    }
+  }
+}
+
+// Copy nodes in reverse letter order, to test IndexWriter::copy_node.
+static IndexReader::Node CopyNode(IndexReader const& reader, off_t node,
+                                  int64_t count, IndexWriter* writer) {
+  IndexReader::Cursor cursor;
+  reader.cursor(node, count, CHAR_MIN, CHAR_MAX, &cursor);
+  bool summarized = cursor.summarized;
+  IndexReader::Summary summary = cursor.summary;
+  std::vector<IndexReader::Choice> choices;
+  while (cursor.next()) choices.push_back(cursor.choice);
+  for (size_t i = choices.size(); i > 0; --i)
+    if (choices[i - 1].next != -1)
+      choices[i - 1].next =
+          CopyNode(reader, choices[i - 1].next, choices[i - 1].count, writer);
+  return writer->copy_node(choices, cursor.count,
+                           summarized ? &summary : NULL);
+}
+
+// Returns the size of the index written.
+static off_t TestIndex(const char *name, Entries entries, off_t span,
+                       bool compact = false, bool shared = false) {
+  // Write index
+
+  FILE *fp = fopen("test-index.index", "wb");
+  if (fp == NULL) {
+    fprintf(stderr, "FAIL: can't write test-index.index\n");
+    exit(1);
+  }
+
+  std::sort(entries.begin(), entries.end());
+  IndexWriter writer(fp);
+  writer.set_summary_span(span);
+  writer.set_compact(compact);
+  writer.set_shared(shared ? 1000 : 0);
+  for (size_t i = 0; i < entries.size(); ++i)
+    writer.next(entries[i].first.c_str(), 0, entries[i].second);
+  writer.next(NULL, 0, 0);
+  off_t size = ftello(fp);
+  fclose(fp);
+
+  // Read index, with and without the top levels cached
+
+  for (int depth = 0; depth <= 2; depth += 2) {
+    fp = fopen("test-index.index", "rb");
+    if (fp == NULL) {
+      fprintf(stderr, "FAIL: can't open test-index.index\n");
+      exit(1);
+    }
+
+    IndexReader::Options options;
+    options.cache_depth = depth;
+    IndexReader reader(fp, options);
+    CheckIndex(name, entries, span, reader);
+    fclose(fp);
+  }
+
+  // Copy the index node by node, and read the copy
+
+  fp = fopen("test-index.index", "rb");
+  FILE *copy_fp = fopen("test-index-copy.index", "wb");
+  if (fp == NULL || copy_fp == NULL) {
+    fprintf(stderr, "FAIL: can't copy test-index.index\n");
+    exit(1);
+  }
+
+  IndexReader reader(fp);
+  IndexWriter copier(copy_fp);
+  copier.set_compact(!compact);
+  copier.finish(reader.root() == -1 ? -1 :
+                CopyNode(reader, reader.root(), reader.count(), &copier),
+                reader.count());
+  fclose(copy_fp);
+  fclose(fp);
+
+  fp = fopen("test-index-copy.index", "rb");
+  if (fp == NULL) {
+    fprintf(stderr, "FAIL: can't open test-index-copy.index\n");
+    exit(1);
+  }
+
+  IndexReader copy(fp);
+  CheckIndex(name, entries, span, copy);
+  fclose(fp);
+
+  remove("test-index.index");
+  remove("test-index-copy.index");
+  return size;
+}
+
+static void TestApproximate(const char *name, Entries entries) {
+  int64_t total = 0;
+  for (size_t i = 0; i < entries.size(); ++i) total += entries[i].second;
+  std::vector<int64_t> scale = IndexWriter::log_scale(total);
+  for (int i = 2; i < 256; ++i) {
+    if (scale[i] <= scale[i - 1] || (i < 8 && scale[i] != i)) {
+      fprintf(stderr, "FAIL: %s: scale[%d] = %" PRId64 "\n",
+          name, i, scale[i]);
+      exit(1);
+    }
+  }
+
+  if (total > 255 && scale[255] != total) {
+    fprintf(stderr, "FAIL: %s: scale[255] = %" PRId64 " (expected %" PRId64
+        ")\n", name, scale[255], total);
+    exit(1);
+  }
+
+  FILE *fp = fopen("test-index.index", "wb");
+  if (fp == NULL) {
+    fprintf(stderr, "FAIL: can't write test-index.index\n");
+    exit(1);
+  }
+
+  std::sort(entries.begin(), entries.end());
+  IndexWriter writer(fp);
+  writer.set_scale(scale);
+  for (size_t i = 0; i < entries.size(); ++i)
+    writer.next(entries[i].first.c_str(), 0, entries[i].second);
+  writer.next(NULL, 0, 0);
+  fclose(fp);
+
+  fp = fopen("test-index.index", "rb");
+  if (fp == NULL) {
+    fprintf(stderr, "FAIL: can't open test-index.index\n");
+    exit(1);
+  }
+
+  // Each first letter's count should be within a step of the scale
+  IndexReader reader(fp);
+  if (reader.version() != 2 || reader.count() != total ||
+      reader.scale() != scale) {
+    fprintf(stderr, "FAIL: %s: version %d, total %" PRId64 "\n",
+        name, reader.version(), reader.count());
+    exit(1);
+  }
+
+  std::vector<IndexReader::Choice> choices;
+  reader.children(reader.root(), reader.count(), CHAR_MIN, CHAR_MAX, &choices);
+  for (size_t i = 0, e = 0; i < choices.size(); ++i) {
+    int64_t exact = 0;
+    for (; e < entries.size() && entries[e].first[0] == choices[i].ch; ++e)
+      exact += entries[e].second;
+    if (choices[i].count > exact * 1.1 + 1 ||
+        choices[i].count < exact / 1.1 - 1) {
+      fprintf(stderr, "FAIL: %s: [%c] * %" PRId64 " (expected %" PRId64
+          ")\n", name, choices[i].ch, choices[i].count, exact);
+      exit(1);
+    }
+  }
+
+  fclose(fp);
+  remove("test-index.index");
+}
+
+static std::vector<char> ReadAll(FILE* fp) {
+  std::vector<char> out;
+  fseeko(fp, 0, SEEK_SET);
+  int ch;
+  while ((ch = getc(fp)) != EOF) out.push_back(ch);
+  return out;
+}
+
+static void TestParts(const char *name, Entries entries, off_t span) {
+  // Write the index whole, and again in two parts (split by first letter)
+  std::sort(entries.begin(), entries.end());
+  FILE *whole_fp = tmpfile(), *fp = tmpfile();
+  FILE *part_fp[2] = { tmpfile(), tmpfile() };
+  if (whole_fp == NULL || fp == NULL || part_fp[0] == NULL ||
+      part_fp[1] == NULL) {
+    fprintf(stderr, "FAIL: %s: can't make temporary files\n", name);
+    exit(1);
+  }
+
+  IndexWriter whole(whole_fp), writer(fp);
+  IndexWriter part0(part_fp[0]), part1(part_fp[1]);
+  IndexWriter* parts[2] = { &part0, &part1 };
+  whole.set_summary_span(span);
+  writer.set_summary_span(span);
+  for (int i = 0; i < 2; ++i) parts[i]->set_summary_span(span);
+  for (size_t i = 0; i < entries.size(); ++i) {
+    char const* text = entries[i].first.c_str();
+    whole.next(text, 0, entries[i].second);
+    parts[text[0] >= 'm']->next(text, 0, entries[i].second);
+  }
+  whole.next(NULL, 0, 0);
+  for (int i = 0; i < 2; ++i) {
+    parts[i]->end_part();
+    writer.add_part(parts[i]);
+  }
+  writer.next(NULL, 0, 0);
+
+  // The joined parts should match byte for byte
+  std::vector<char> a = ReadAll(whole_fp), b = ReadAll(fp);
+  if (a != b) {
+    fprintf(stderr, "FAIL: %s: parts: %zu bytes vs %zu whole\n",
+        name, b.size(), a.size());
+    exit(1);
+  }
+
+  fclose(whole_fp);
+  fclose(fp);
+  fclose(part_fp[0]);
+  fclose(part_fp[1]);
+}
+
+static void TestBackground(const char *name, Entries entries) {
+  // Write the index with blocks written in the background and without
+  std::sort(entries.begin(), entries.end());
+  FILE *files[2] = { tmpfile(), tmpfile() };
+  if (files[0] == NULL || files[1] == NULL) {
+    fprintf(stderr, "FAIL: %s: can't make temporary files\n", name);
+    exit(1);
+  }
+
+  for (int background = 0; background < 2; ++background) {
+    IndexWriter writer(files[background]);
+    writer.set_background(background);
+    for (size_t i = 0; i < entries.size(); ++i)
+      writer.next(entries[i].first.c_str(), 0, entries[i].second);
+    writer.next(NULL, 0, 0);
+  }
+
+  // They should match byte for byte, across several blocks
+  std::vector<char> a = ReadAll(files[0]), b = ReadAll(files[1]);
+  if (a != b || a.size() < (2 << 20)) {
+    fprintf(stderr, "FAIL: %s: %zu bytes in the background vs %zu\n",
+        name, b.size(), a.size());
+    exit(1);
+  }
+
+  IndexReader reader(files[1]);
+  CheckIndex(name, entries, 0, reader);
+  fclose(files[0]);
+  fclose(files[1]);
+}
+
+static void TestMerge(const char *name, Entries entries, size_t inputs) {
+  // Deal the entries out among the inputs, every third one to two of them
+  std::sort(entries.begin(), entries.end());
+  std::vector<FILE*> files;
+  std::vector<IndexWriter*> writers;
+  for (size_t i = 0; i < inputs; ++i) {
+    files.push_back(tmpfile());
+    if (files.back() == NULL) {
+      fprintf(stderr, "FAIL: %s: can't make temporary files\n", name);
+      exit(1);
+    }
+    writers.push_back(new IndexWriter(files.back()));
+  }
+
+  Entries expect;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    char const* text = entries[i].first.c_str();
+    for (size_t j = i; j <= i + (i % 3 == 0 && inputs > 1); ++j) {
+      writers[j % inputs]->next(text, 0, entries[i].second);
+      expect.push_back(entries[i]);
+    }
+  }
+
+  std::vector<IndexReader*> readers;
+  std::vector<IndexWalker*> walkers;
+  for (size_t i = 0; i < inputs; ++i) {
+    writers[i]->next(NULL, 0, 0);
+    delete writers[i];
+    readers.push_back(new IndexReader(files[i]));
+    walkers.push_back(new IndexWalker(readers.back(), readers.back()->root(),
+                                      readers.back()->count()));
+  }
+
+  // The merge should give every entry in order, and exactly what each
+  // shares with the one before
+  {
+    WalkerMerge merge(walkers);
+    std::string last;
+    for (size_t i = 0; i < expect.size(); ++i, merge.next()) {
+      int same = 0;
+      while (last[same] != '\0' && last[same] == expect[i].first[same]) ++same;
+      if (merge.text == NULL || expect[i].first != merge.text ||
+          expect[i].second != merge.count || merge.same != same) {
+        fprintf(stderr, "FAIL: %s: [%s] * %" PRId64 " same %" PRId64
+            " (expected [%s] * %" PRId64 " same %d)\n", name,
+            merge.text ? merge.text : "NULL", merge.count, merge.same,
+            expect[i].first.c_str(), expect[i].second, same);
+        exit(1);
+      }
+      last = merge.text;
+    }
+
+    if (merge.text != NULL) {
+      fprintf(stderr, "FAIL: %s: [%s] (extra)\n", name, merge.text);
+      exit(1);
+    }
+  }
+
+  for (size_t i = 0; i < inputs; ++i) {
+    delete readers[i];
+    fclose(files[i]);
+  }
+}
+
+static void TestPrune(const char *name, Entries entries) {
+  std::sort(entries.begin(), entries.end());
+  FILE *fp = tmpfile();
+  if (fp == NULL) {
+    fprintf(stderr, "FAIL: %s: can't make temporary files\n", name);
+    exit(1);
+  }
+
+  {
+    IndexWriter writer(fp);
+    for (size_t i = 0; i < entries.size(); ++i)
+      writer.next(entries[i].first.c_str(), 0, entries[i].second);
+    writer.next(NULL, 0, 0);
+  }
+
+  // Pruning should write the same bytes as merging the index again
+  IndexReader reader(fp);
+  static const int64_t cutoffs[] = { 1, 2, 3, 5, 10, 100, 1000, 1 << 20 };
+  for (size_t c = 0; c < sizeof(cutoffs) / sizeof(cutoffs[0]); ++c) {
+    FILE *files[2] = { tmpfile(), tmpfile() };
+    if (files[0] == NULL || files[1] == NULL) {
+      fprintf(stderr, "FAIL: %s: can't make temporary files\n", name);
+      exit(1);
+    }
+
+    {
+      IndexWriter output(files[0]);
+      FrequencyCutoffWriter writer(&output, cutoffs[c]);
+      std::vector<IndexWalker*> walker(1, new IndexWalker(
+          &reader, reader.root(), reader.count()));
+      for (WalkerMerge merge(walker); merge.text != NULL; merge.next())
+        writer.next(merge.text, merge.same, merge.count);
+      writer.next(NULL, 0, 0);
+    }
+
+    {
+      IndexWriter output(files[1]);
+      IndexPruner pruner(&reader, &output, cutoffs[c]);
+      pruner.run();
+    }
+
+    std::vector<char> a = ReadAll(files[0]), b = ReadAll(files[1]);
+    if (a != b) {
+      fprintf(stderr, "FAIL: %s: cutoff %" PRId64 ": pruned to %zu bytes "
+          "vs %zu merged\n", name, cutoffs[c], b.size(), a.size());
+      exit(1);
+    }
+    fclose(files[0]);
+    fclose(files[1]);
+  }
+  fclose(fp);
+}
+
+// Adds up the texts below an overlay node and their counts.
+static void ListOverlay(IndexOverlay const& overlay, IndexOverlay::Node node,
+                        int64_t count, std::string const& prefix,
+                        std::map<std::string, int64_t>* out) {
+  std::vector<IndexReader::Choice> choices;
+  int64_t rest = overlay.children(node, count, CHAR_MIN, CHAR_MAX, &choices);
+  if (rest > 0) (*out)[prefix] += rest;
+  for (size_t i = 0; i < choices.size(); ++i) {
+    std::string text = prefix + choices[i].ch;
+    if (choices[i].next == -1)
+      (*out)[text] += choices[i].count;
+    else
+      ListOverlay(overlay, choices[i].next, choices[i].count, text, out);
+  }
+}
+
+static void TestOverlay(const char *name, std::vector<Entries> segments) {
+  // Write a base index and deltas, then open them all by the base's name
+  std::map<std::string, int64_t> expect;
+  for (size_t i = 0; i < segments.size(); ++i) {
+    std::string file = (i == 0) ? std::string("test-index.index") :
+        IndexShards::delta_name("test-index.index", i - 1);
+    FILE *fp = fopen(file.c_str(), "wb");
+    if (fp == NULL) {
+      fprintf(stderr, "FAIL: %s: can't write %s\n", name, file.c_str());
+      exit(1);
+    }
+
+    std::sort(segments[i].begin(), segments[i].end());
+    IndexWriter writer(fp);
+    writer.set_summary_span(1);
+    for (size_t j = 0; j < segments[i].size(); ++j) {
+      writer.next(segments[i][j].first.c_str(), 0, segments[i][j].second);
+      expect[segments[i][j].first] += segments[i][j].second;
+    }
+    writer.next(NULL, 0, 0);
+    fclose(fp);
+  }
+
+  {
+    IndexShards index("test-index.index");
+    const IndexOverlay* overlay = index.overlay();
+    if (index.deltas().size() + 1 != segments.size() ||
+        (overlay == NULL) != (segments.size() == 1)) {
+      fprintf(stderr, "FAIL: %s: %zu deltas\n", name, index.deltas().size());
+      exit(1);
+    }
+
+    if (overlay != NULL) {
+      std::map<std::string, int64_t> found;
+      ListOverlay(*overlay, overlay->root(), overlay->count(), "", &found);
+      if (found != expect) {
+        fprintf(stderr, "FAIL: %s: %zu texts (expected %zu)\n",
+            name, found.size(), expect.size());
+        exit(1);
+      }
+
+      // Every part has a summary, so the overlay does too
+      IndexReader::Summary summary;
+      if (!expect.empty() &&
+          !overlay->summary(overlay->root(), overlay->count(), &summary)) {
+        fprintf(stderr, "FAIL: %s: no summary\n", name);
+        exit(1);
+      }
+    }
+  }
+
+  remove("test-index.index");
+  for (size_t i = 1; i < segments.size(); ++i)
+    remove(IndexShards::delta_name("test-index.index", i - 1).c_str());
+}
+
+static void TestShards() {
+  // Write two shards, then open them by the unsharded name
+  for (int shard = 0; shard < 2; ++shard) {
+    std::string name = IndexShards::shard_name("test-index.index", shard);
+    FILE *fp = fopen(name.c_str(), "wb");
+    if (fp == NULL) {
+      fprintf(stderr, "FAIL: can't write %s\n", name.c_str());
+      exit(1);
+    }
+
+    IndexWriter writer(fp);
+    writer.next(shard ? "dog " : "cat ", 0, 2 + shard);
+    writer.next(NULL, 0, 0);
+    fclose(fp);
+  }
+
+  if (IndexShards::shard_name("test-index.index", 1) != "test-index.1.index" ||
+      IndexShards::shard_name("test", 0) != "test.0.index") {
+    fprintf(stderr, "FAIL: shard names\n");
+    exit(1);
+  }
+
+  {
+    IndexShards shards("test-index.index");
+    if (shards.readers().size() != 2 ||
+        shards.readers()[0]->count() != 2 ||
+        shards.readers()[1]->count() != 3) {
+      fprintf(stderr, "FAIL: shards: %zu\n", shards.readers().size());
+      exit(1);
+    }
+  }
+
+  remove("test-index.0.index");
+  remove("test-index.1.index");
+}
+
+int main(int argc, char *argv[]) {
+  static const char letters[] = " 0123456789abcdefghijklmnopqrstuvwxyz";
+
+  TestIndex("empty", Entries(), 0);
+
+  Entries few;
+  few.push_back(std::make_pair("cat ", 3));
+  few.push_back(std::make_pair("cats ", 1));
+  few.push_back(std::make_pair("dog ", 2));
+  TestIndex("few", few, 0);
+  TestIndex("few summarized", few, 1);
+
+  Entries ends;
+  ends.push_back(std::make_pair("ca", 1));
+  ends.push_back(std::make_pair("cat ", 2));
+  ends.push_back(std::make_pair("dog ", 1));
+  ends.push_back(std::make_pair("dogs", 3));
+  TestIndex("ends", ends, 0);
+  TestIndex("ends summarized", ends, 1);
+
+  Entries wide;
+  for (const char *a = letters; *a; ++a)
+    wide.push_back(std::make_pair(std::string(1, *a) + " ", 1 + (*a % 7)));
+  TestIndex("wide", wide, 0);
+  TestIndex("wide summarized", wide, 1);
+  TestIndex("wide compact", wide, 0, true);
+
+  Entries deep;
+  for (const char *a = letters + 1; *a; ++a)
+    for (size_t b = 0; b < sizeof(letters) - 1; b += 3)
+      deep.push_back(std::make_pair(std::string(1, *a) + letters[b] + " ",
+                                    (int64_t(1) << (b % 24)) + *a));
+  TestIndex("deep", deep, 0);
+  TestIndex("deep summarized", deep, 1);
+  TestIndex("deep compact", deep, 0, true);
+  TestIndex("deep compact summarized", deep, 1, true);
+  TestApproximate("deep approximate", deep);
+
+  Entries odd;
+  for (const char *a = letters; *a; ++a)
+    odd.push_back(std::make_pair(std::string(1, *a) + " ", 5));
+  odd.push_back(std::make_pair("A ", 5));
+  odd.push_back(std::make_pair("~ ", 5));
+  TestIndex("odd", odd, 0);
+  TestIndex("odd summarized", odd, 1);
+  TestIndex("odd compact", odd, 0, true);
+
+  // Every first letter leads to the same subtree
+  Entries repeated;
+  for (const char *a = letters + 11; *a; ++a)
+    for (size_t b = 11; b < sizeof(letters) - 1; b += 5) {
+      repeated.push_back(std::make_pair(std::string(1, *a) + letters[b] + " ",
+                                        3));
+      repeated.push_back(std::make_pair(std::string(1, *a) + letters[b] + "s ",
+                                        1));
+    }
+  off_t unshared = TestIndex("repeated", repeated, 0);
+  if (TestIndex("repeated shared", repeated, 0, false, true) * 4 > unshared ||
+      TestIndex("repeated shared compact", repeated, 0, true, true) * 4 >
+          unshared) {
+    fprintf(stderr, "FAIL: repeated shared: not smaller\n");
+    exit(1);
+  }
+  TestIndex("repeated shared summarized", repeated, 1, false, true);
+
+  // With a text of its own under each first letter, only the subtrees below
+  // are shared.  The first letters' nodes then write little themselves, and
+  // shouldn't get a (13-byte) summary for the copies they point back to.
+  Entries varied = repeated;
+  for (const char *a = letters + 11; *a; ++a)
+    varied.push_back(std::make_pair(std::string(1, *a) + " ", *a));
+  if (TestIndex("varied shared summarized", varied, 64, false, true) >
+      TestIndex("varied shared", varied, 0, false, true) + 2 * 13) {
+    fprintf(stderr, "FAIL: varied shared summarized: too many summaries\n");
+    exit(1);
+  }
+
+  TestParts("deep parts", deep, 0);
+  TestParts("deep summarized parts", deep, 1);
+  TestParts("wide parts", wide, 0);
+
+  // Numbers in words, enough for an index of a few megabytes
+  Entries numbers;
+  for (int i = 0; i < 300000; ++i) {
+    char text[32];
+    snprintf(text, sizeof(text), "%" PRId64 " %d ",
+             int64_t(i) * 7919 % 1000003, i % 97);
+    numbers.push_back(std::make_pair(text, 1 + i % 13));
+  }
+  TestBackground("numbers background", numbers);
+
+  // Phrases of a few short words, many of them starting others, with
+  // counts from 1 to 1500
+  static const char* const words[] = {
+    "a", "an", "and", "at", "ate", "cat", "cats", "dog", "i", "in", "it",
+  };
+  const size_t num_words = sizeof(words) / sizeof(words[0]);
+  std::map<std::string, int64_t> counts;
+  for (size_t i = 0; i < 20000; ++i) {
+    std::string text;
+    for (size_t n = i, len = 1 + i % 4; len > 0; --len, n /= num_words)
+      text = text + words[n % num_words] + " ";
+    counts[text] = 1 + (i * 7919) % 1500;
+  }
+  Entries phrases(counts.begin(), counts.end());
+
+  TestPrune("empty prune", Entries());
+  TestPrune("few prune", few);
+  TestPrune("ends prune", ends);
+  TestPrune("deep prune", deep);
+  TestPrune("odd prune", odd);
+  TestPrune("varied prune", varied);
+  TestPrune("numbers prune", numbers);
+  TestPrune("phrases prune", phrases);
+
+  TestMerge("empty merge", Entries(), 3);
+  TestMerge("deep merge 1", deep, 1);
+  TestMerge("deep merge 2", deep, 2);
+  TestMerge("deep merge 7", deep, 7);
+  TestMerge("ends merge 5", ends, 5);
+  TestMerge("repeated merge 64", repeated, 64);
+
+  std::vector<Entries> segments(1, deep);
+  TestOverlay("no deltas", segments);
+  segments.push_back(few);
+  segments.push_back(ends);
+  segments.push_back(Entries());
+  segments.push_back(odd);
+  TestOverlay("deltas", segments);
+  segments.assign(2, deep);
+  TestOverlay("same deltas", segments);
+
+  TestShards();
+  return 0;
+}
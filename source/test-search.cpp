@@ -0,0 +1,548 @@
+#include "index.h"
+#include "search.h"
+
+#include <algorithm>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include <fcntl.h>
+#include <inttypes.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// The parts of SearchDriver tried out here, which it keeps to itself
+struct SearchTest {
+  typedef SearchDriver::Frontier Frontier;
+  typedef SearchDriver::Next Next;
+};
+
+typedef SearchTest::Frontier Frontier;
+typedef SearchTest::Next Next;
+typedef std::vector<std::pair<std::string, int64_t> > Entries;
+typedef std::vector<std::pair<double, std::string> > Results;
+
+static uint64_t Random() {
+  static uint64_t state = 0x9e3779b97f4a7c15ULL;  // xorshift64
+  state ^= state << 13;
+  state ^= state >> 7;
+  state ^= state << 17;
+  return state;
+}
+
+// A score from min up to (not including) max.  Whole numbers under 2^27
+// have keys of their own, so the frontier orders them exactly.
+static int64_t Between(int64_t min, int64_t max) {
+  return min + Random() % (max - min);
+}
+
+// Pushes a node for each score in steps, or pops one for each zero, then
+// pops the rest, checking that what comes out is the best of what's left of
+// all that went in: with a limit, the best that many.
+static void TestBeam(const char *name, size_t limit,
+                     std::vector<int64_t> const& steps) {
+  Frontier frontier;
+  frontier.limit = limit;
+  std::vector<int64_t> kept;  // What the frontier should have, least first
+  double dropped = 0;
+  for (size_t i = 0; i <= steps.size() || !kept.empty(); ++i) {
+    if (i < steps.size() && steps[i] > 0) {
+      Next next = Next();
+      next.key = Frontier::key(steps[i]);
+      next.count = steps[i];
+      frontier.push(next);
+      kept.insert(std::upper_bound(kept.begin(), kept.end(), steps[i]),
+                  steps[i]);
+      if (limit > 0 && kept.size() > limit) {
+        dropped += kept.front();
+        kept.erase(kept.begin());
+      }
+      continue;
+    }
+
+    if (frontier.empty() != kept.empty()) {
+      fprintf(stderr, "FAIL: %s: step %zu: %s (expected %zu left)\n", name,
+          i, frontier.empty() ? "empty" : "not empty", kept.size());
+      exit(1);
+    }
+    if (kept.empty()) continue;
+
+    Next next;
+    frontier.pop(&next);
+    if (next.count != kept.back()) {
+      fprintf(stderr, "FAIL: %s: step %zu: popped %" PRId64
+          " (expected %" PRId64 ")\n", name, i, int64_t(next.count),
+          kept.back());
+      exit(1);
+    }
+    kept.pop_back();
+  }
+
+  if (!frontier.empty()) {
+    fprintf(stderr, "FAIL: %s: not empty at the end\n", name);
+    exit(1);
+  }
+
+  // Each dropped score is counted as the most its key allows.
+  if (fabs(frontier.discarded() - dropped) > dropped * 1e-7) {
+    fprintf(stderr, "FAIL: %s: discarded %.9g (expected %.9g)\n", name,
+        frontier.discarded(), dropped);
+    exit(1);
+  }
+}
+
+// Takes every text that ends in a space (state 1 is after one).
+class WordFilter: public SearchFilter {
+ public:
+  bool is_accepting(State state) const { return state == 1; }
+  bool is_state(State state) const { return state == 0 || state == 1; }
+  bool has_transition(State from, char ch, State* to) const {
+    *to = (ch == ' ');
+    return true;
+  }
+};
+
+// Takes texts of two words (a result never restarts, so with restarts,
+// this is what lets a text be found along more than one path).
+class PairFilter: public SearchFilter {
+ public:
+  bool is_accepting(State state) const { return state == 2; }
+  bool is_state(State state) const { return state >= 0 && state <= 2; }
+  bool has_transition(State from, char ch, State* to) const {
+    if (from == 2) return false;
+    *to = from + (ch == ' ');
+    return true;
+  }
+};
+
+// Words of a few random letters, each with a random count.
+static Entries Words(size_t count) {
+  static const char letters[] = "0123456789abcdefghijklmnopqrstuvwxyz";
+  Entries entries;
+  for (size_t i = 0; i < count; ++i) {
+    std::string word;
+    for (int64_t len = Between(1, 5); len > 0; --len)
+      word += letters[Random() % (sizeof(letters) - 1)];
+    entries.push_back(std::make_pair(word + " ", Between(1, 1000)));
+  }
+  return entries;
+}
+
+// Sorts entries, adding up the counts of any text that came up twice.
+static Entries Sorted(Entries entries) {
+  std::sort(entries.begin(), entries.end());
+  Entries out;
+  for (size_t i = 0; i < entries.size(); ++i) {
+    if (!out.empty() && out.back().first == entries[i].first)
+      out.back().second += entries[i].second;
+    else
+      out.push_back(entries[i]);
+  }
+  return out;
+}
+
+// Writes the entries (in order) as an index.
+static void WriteIndex(std::string const& name, Entries const& entries) {
+  FILE *fp = fopen(name.c_str(), "wb");
+  if (fp == NULL) {
+    fprintf(stderr, "FAIL: can't write %s\n", name.c_str());
+    exit(1);
+  }
+
+  IndexWriter writer(fp);
+  for (size_t i = 0; i < entries.size(); ++i)
+    writer.next(entries[i].first.c_str(), 0, entries[i].second);
+  writer.next(NULL, 0, 0);
+  fclose(fp);
+}
+
+// The first results of a search (or all, if there are fewer), checking
+// that they come best first (to within the frontier's precision), or with
+// slack, that none scores more than that much above any before it.
+static Results Search(const char *name, SearchDriver* driver, size_t most,
+                      double slack = 0) {
+  Results out;
+  double least = HUGE_VAL;
+  while (out.size() < most) {
+    driver->next();
+    if (driver->text == NULL) break;
+    if (driver->score > least * (1 + slack) * (1 + 1e-7)) {
+      fprintf(stderr, "FAIL: %s: [%s] %.9g after %.9g\n", name,
+          driver->text, driver->score, least);
+      exit(1);
+    }
+    least = std::min(least, driver->score);
+    out.push_back(std::make_pair(driver->score, std::string(driver->text)));
+  }
+  return out;
+}
+
+static bool MoreCommon(std::pair<std::string, int64_t> const& a,
+                       std::pair<std::string, int64_t> const& b) {
+  return a.second > b.second;
+}
+
+static bool Better(std::pair<double, std::string> const& a,
+                   std::pair<double, std::string> const& b) {
+  return a.first > b.first || (a.first == b.first && a.second < b.second);
+}
+
+// Checks that two searches found the same results with the same scores.
+// Ties may come in any order, and if the searches were cut short, so may
+// those tied with the last.
+static void SameResults(const char *name, Results a, Results b) {
+  std::sort(a.begin(), a.end(), Better);
+  std::sort(b.begin(), b.end(), Better);
+  if (a.size() != b.size()) {
+    fprintf(stderr, "FAIL: %s: %zu results (expected %zu)\n", name,
+        b.size(), a.size());
+    exit(1);
+  }
+
+  const double last = a.empty() ? 0 : a.back().first * (1 + 1e-7);
+  for (size_t i = 0; i < a.size() && a[i].first > last; ++i) {
+    if (a[i] != b[i]) {
+      fprintf(stderr, "FAIL: %s: [%s] %.9g (expected [%s] %.9g)\n", name,
+          b[i].second.c_str(), b[i].first, a[i].second.c_str(), a[i].first);
+      exit(1);
+    }
+  }
+}
+
+// Splits an index into shards as merge-indexes -n does, and checks that
+// searching them together finds what searching the whole index does.
+static void TestShards(const char *name, Entries const& entries, int shards,
+                       double restart, size_t most) {
+  int64_t first[256] = { 0 };
+  for (size_t i = 0; i < entries.size(); ++i)
+    first[(unsigned char) entries[i].first[0]] += entries[i].second;
+  int shard_of[256];
+  IndexShards::partition(first, shards, shard_of);
+  for (int ch = 1; ch < 256; ++ch) {
+    if (shard_of[ch] < shard_of[ch - 1] || shard_of[ch] >= shards) {
+      fprintf(stderr, "FAIL: %s: '%c' in shard %d\n", name, ch, shard_of[ch]);
+      exit(1);
+    }
+  }
+
+  WriteIndex("test-search-whole.index", entries);
+  std::vector<Entries> parts(shards);
+  for (size_t i = 0; i < entries.size(); ++i)
+    parts[shard_of[(unsigned char) entries[i].first[0]]].push_back(entries[i]);
+  for (int i = 0; i < shards; ++i) {
+    if (parts[i].empty()) {
+      fprintf(stderr, "FAIL: %s: shard %d is empty\n", name, i);
+      exit(1);
+    }
+    WriteIndex(IndexShards::shard_name("test-search.index", i), parts[i]);
+  }
+
+  WordFilter filter;
+  Results whole, sharded;
+  {
+    IndexShards index("test-search-whole.index");
+    SearchDriver driver(index, &filter, 0, restart);
+    whole = Search(name, &driver, most);
+  }
+  {
+    IndexShards index("test-search.index");
+    if (index.readers().size() != size_t(shards)) {
+      fprintf(stderr, "FAIL: %s: %zu shards\n", name, index.readers().size());
+      exit(1);
+    }
+    SearchDriver driver(index, &filter, 0, restart);
+    sharded = Search(name, &driver, most);
+  }
+  SameResults(name, whole, sharded);
+  if (restart == 0 && whole.size() != entries.size()) {
+    fprintf(stderr, "FAIL: %s: %zu results (expected %zu)\n", name,
+        whole.size(), entries.size());
+    exit(1);
+  }
+
+  remove("test-search-whole.index");
+  for (int i = 0; i < shards; ++i)
+    remove(IndexShards::shard_name("test-search.index", i).c_str());
+}
+
+// Checks that a search for pairs of words on several threads finds what it
+// does on one.  With restarts, a pair can be found along more than one path
+// (a phrase in the index, or its words one after another), so the threads
+// may find a worse path first and have to swap the better one in.
+static void TestThreads(const char *name, Entries const& entries,
+                        double restart, size_t most, double slack) {
+  WriteIndex("test-search.index", entries);
+  {
+    IndexShards index("test-search.index");
+    PairFilter filter;
+    Results one, many;
+    {
+      SearchDriver driver(index, &filter, 0, restart);
+      one = Search(name, &driver, most);
+    }
+    {
+      SearchDriver driver(index, &filter, 0, restart);
+      driver.set_threads(4, slack);
+      many = Search(name, &driver, most, slack);
+    }
+
+    // (With slack, the first few are only the same if they are all.)
+    if (slack == 0 || one.size() < most) SameResults(name, one, many);
+  }
+  remove("test-search.index");
+}
+
+// Saves a frontier of one node, at an index node and in a filter state, and
+// checks that loading it back for an index of so many bytes (and the pair
+// filter) takes it just if it should.
+static void TestLoad(const char *name, IndexReader::Node node,
+                     SearchFilter::State state, ssize_t nodes, bool valid) {
+  Next next = Next();
+  next.key = Frontier::key(10);
+  next.node = node;
+  next.count = 10;
+  next.ch = 'a';
+  next.crumb = 0;
+  next.state = state;
+  Frontier saved;
+  saved.push(next);
+  FILE *fp = tmpfile();
+  saved.save(fp, 0);
+  rewind(fp);
+
+  PairFilter filter;
+  Frontier loaded;
+  if (loaded.load(fp, std::vector<bool>(1, true), nodes, &filter) != valid) {
+    fprintf(stderr, "FAIL: %s: %s\n", name, valid ? "refused" : "taken");
+    exit(1);
+  }
+  fclose(fp);
+}
+
+// Stops a search for pairs of words after its first results and saves a
+// cursor, then checks that a search resumed from it finds just what the
+// first would have gone on to, and that the cursor is turned away when cut
+// short anywhere, or by a search for something else.
+static void TestCursor(const char *name, Entries const& entries,
+                       double restart, size_t first, size_t most) {
+  WriteIndex("test-search.index", entries);
+  {
+    IndexShards index("test-search.index");
+    PairFilter filter;
+    Results whole, resumed;
+    {
+      SearchDriver driver(index, &filter, 0, restart);
+      whole = Search(name, &driver, most);
+    }
+
+    FILE *fp = tmpfile();
+    {
+      SearchDriver driver(index, &filter, 0, restart);
+      resumed = Search(name, &driver, first);
+      if (!driver.save(fp, "key")) {
+        fprintf(stderr, "FAIL: %s: not saved\n", name);
+        exit(1);
+      }
+    }
+    std::vector<char> cursor(ftell(fp));
+    rewind(fp);
+    if (fread(&cursor[0], 1, cursor.size(), fp) != cursor.size()) {
+      fprintf(stderr, "FAIL: %s: can't read the cursor back\n", name);
+      exit(1);
+    }
+
+    // Saved with a limit of its own size, the cursor is the same; with one
+    // byte less, it isn't saved.
+    for (int fits = 0; fits < 2; ++fits) {
+      FILE *limited = tmpfile();
+      SearchDriver driver(index, &filter, 0, restart);
+      Search(name, &driver, first);
+      if (driver.save(limited, "key", cursor.size() - 1 + fits) != bool(fits) ||
+          (fits && ftell(limited) != long(cursor.size()))) {
+        fprintf(stderr, "FAIL: %s: saved %ld bytes within %zu\n", name,
+            ftell(limited), cursor.size() - 1 + fits);
+        exit(1);
+      }
+      fclose(limited);
+    }
+
+    {
+      rewind(fp);
+      SearchDriver driver(index, &filter, 0, restart);
+      if (!driver.resume(fp, "key")) {
+        fprintf(stderr, "FAIL: %s: not resumed\n", name);
+        exit(1);
+      }
+      Results rest = Search(name, &driver, most - first);
+      resumed.insert(resumed.end(), rest.begin(), rest.end());
+    }
+    for (size_t i = 0; i < whole.size() || i < resumed.size(); ++i) {
+      if (i == whole.size() || i == resumed.size() || whole[i] != resumed[i]) {
+        fprintf(stderr, "FAIL: %s: result %zu differs when resumed\n", name,
+            i);
+        exit(1);
+      }
+    }
+
+    // (What's wrong with each is printed; there's no need to see it.)
+    fflush(stderr);
+    const int err = dup(2), null = open("/dev/null", O_WRONLY);
+    dup2(null, 2);
+    close(null);
+
+    const char *taken = NULL;
+    size_t at = 0;
+    {
+      rewind(fp);
+      SearchDriver driver(index, &filter, 0, restart);
+      if (driver.resume(fp, "other key")) taken = "for another key";
+    }
+    {
+      rewind(fp);
+      SearchDriver driver(index, &filter, 0, restart + 1);
+      if (driver.resume(fp, "key")) taken = "for another restart";
+    }
+    std::vector<size_t> cuts;  // A thousand or so, and all but the last byte
+    for (size_t cut = 0; cut < cursor.size(); cut += cursor.size() / 1000 + 1)
+      cuts.push_back(cut);
+    cuts.push_back(cursor.size() - 1);
+    for (size_t i = 0; i < cuts.size() && taken == NULL; ++i) {
+      FILE *cut_fp = tmpfile();
+      fwrite(&cursor[0], 1, cuts[i], cut_fp);
+      rewind(cut_fp);
+      SearchDriver driver(index, &filter, 0, restart);
+      if (driver.resume(cut_fp, "key")) {
+        taken = "cut short";
+        at = cuts[i];
+      }
+      fclose(cut_fp);
+    }
+
+    fflush(stderr);
+    dup2(err, 2);
+    close(err);
+    if (taken != NULL) {
+      fprintf(stderr, "FAIL: %s: resumed %s (at %zu of %zu bytes)\n", name,
+          taken, at, cursor.size());
+      exit(1);
+    }
+    fclose(fp);
+  }
+  remove("test-search.index");
+}
+
+// Checks that the search tools' options, given as one string, are taken (or
+// turned away) as they should be.
+static void TestOptions(const char *args, bool valid) {
+  std::vector<std::string> words(1, "test-search");
+  for (const char *p = args; *p != '\0';) {
+    const size_t len = strcspn(p, " ");
+    words.push_back(std::string(p, len));
+    p += len + (p[len] == ' ');
+  }
+  std::vector<char*> argv;
+  for (size_t i = 0; i < words.size(); ++i) argv.push_back(&words[i][0]);
+  argv.push_back(NULL);
+
+  optind = 1;
+  SearchOptions options;
+  if (options.parse(argv.size() - 1, &argv[0]) != valid) {
+    fprintf(stderr, "FAIL: options \"%s\": %s\n", args,
+        valid ? "refused" : "taken");
+    exit(1);
+  }
+}
+
+int main(int argc, char *argv[]) {
+  std::vector<int64_t> steps;
+  for (int i = 0; i < 1000; ++i) steps.push_back(Between(1, 1 << 26));
+  TestBeam("unlimited", 0, steps);
+  TestBeam("never full", steps.size(), steps);
+  TestBeam("full", 100, steps);
+
+  // Every score in one bucket (between 4096 and 5120, a quarter of the way
+  // to the next power of two), so the least must be found within it
+  steps.clear();
+  for (int i = 0; i < 1000; ++i) steps.push_back(Between(4096, 5120));
+  TestBeam("one bucket", 10, steps);
+
+  // Popping takes a bucket into the heap; then every node is in the heap,
+  // with more coming in alongside and above.
+  steps.clear();
+  for (int i = 0; i < 50; ++i) steps.push_back(Between(4096, 5120));
+  steps.push_back(0);
+  for (int i = 0; i < 1000; ++i) {
+    steps.push_back(Between(4096, i % 2 ? 5120 : 1 << 26));
+    if (i % 3 == 0) steps.push_back(0);
+  }
+  TestBeam("all in heap", 20, steps);
+
+  // Scores across many buckets, falling over time as they do in a search,
+  // with popping along the way
+  steps.clear();
+  for (int i = 0; i < 20000; ++i) {
+    const int64_t most = (int64_t(1) << 26) >> (i / 1000);
+    steps.push_back(Between(1, most));
+    if (i % 2 == 0) steps.push_back(0);
+  }
+  TestBeam("falling", 0, steps);
+  TestBeam("falling full", 500, steps);
+  TestBeam("falling tight", 3, steps);
+
+  Entries words = Sorted(Words(3000));
+  TestShards("shards", words, 3, 0, words.size() + 1);
+  TestShards("shards restarting", words, 4, 1e-3, 5000);
+
+  // Pairs of the commonest words as phrases of their own too, each scoring
+  // within a few percent of the pair of words with restarts of 0.01, so
+  // the threads often reach the worse of the two first
+  Entries common = words;
+  std::sort(common.begin(), common.end(), MoreCommon);
+  common.resize(30);
+  int64_t total = 0;
+  for (size_t i = 0; i < words.size(); ++i) total += words[i].second;
+  Entries phrases = words;
+  for (int i = 0; i < 300; ++i) {
+    std::pair<std::string, int64_t> const& a = common[Random() % 30];
+    std::pair<std::string, int64_t> const& b = common[Random() % 30];
+    const double path = 0.01 * a.second * b.second / total;
+    phrases.push_back(std::make_pair(
+        a.first + b.first, int64_t(path * Between(97, 104) / 100) + 1));
+  }
+  phrases = Sorted(phrases);
+  TestThreads("threads", phrases, 0, phrases.size() + 1, 0);
+  TestThreads("threads restarting", phrases, 0.01, 5000, 0);
+  TestThreads("threads with slack", phrases, 0, phrases.size() + 1, 0.02);
+  TestThreads("threads restarting with slack", phrases, 0.01, 5000, 0.02);
+
+  TestCursor("cursor", phrases, 0, 100, phrases.size() + 1);
+  Entries few = Sorted(Words(100));  // (Restarts make a frontier grow fast.)
+  TestCursor("cursor restarting", few, 0.01, 100, 1000);
+  TestOptions("", true);
+  TestOptions("-b 1000 -t 4 -s 0.1", true);
+  TestOptions("-b 0", true);
+  TestOptions("-b -1", false);
+  TestOptions("-t 0", false);
+  TestOptions("-s -0.5", false);
+  TestOptions("-n 100 -w page2.cursor -r page1.cursor", true);
+  TestOptions("-w page2.cursor", false);
+  TestOptions("-n 100 -w page2.cursor -t 2", false);
+  TestOptions("-n 100 -w page2.cursor -W 1000000", true);
+  TestOptions("-n 100 -w page2.cursor -W -1", false);
+  TestOptions("-W 1000000", false);
+
+  TestLoad("cursor node", 1000, 1, 1000, true);
+  TestLoad("cursor node at the start", 1, 1, 1000, true);
+  TestLoad("cursor node at the end", -1, 1, 1000, true);
+  TestLoad("cursor node 0", 0, 1, 1000, false);
+  TestLoad("cursor node past the index", 1001, 1, 1000, false);
+  TestLoad("cursor node before the index", -2, 1, 1000, false);
+  TestLoad("cursor state", 1, 2, 1000, true);
+  TestLoad("cursor state past the filter's", 1, 3, 1000, false);
+  TestLoad("cursor state before the filter's", 1, -1, 1000, false);
+  return 0;
+}